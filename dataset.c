@@ -0,0 +1,998 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include "util.h"
+#include "dataset.h"
+#include "summary.h"
+
+int dataset_iscontainer(char *name) {
+	struct stat st;
+
+	return stat(name, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static int sectioncmp(const void *v1, const void *v2) {
+	const struct section *s1 = v1;
+	const struct section *s2 = v2;
+
+	return strcmp(s1->name, s2->name);
+}
+
+static void open_container(struct dataset *ds) {
+	int fd = open(ds->name, O_RDONLY);
+	if (fd < 0) {
+		perror(ds->name);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	struct container_header h;
+	if (st.st_size < sizeof(h) || read(fd, &h, sizeof(h)) != sizeof(h) ||
+	    memcmp(h.magic, CONTAINER_MAGIC, sizeof(h.magic)) != 0) {
+		fprintf(stderr, "%s: Not a datamaps container\n", ds->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (h.version != 1 && h.version != 2) {
+		fprintf(stderr, "%s: Unknown version %d\n", ds->name, h.version);
+		exit(EXIT_FAILURE);
+	}
+
+	if (h.nsections < 0 || sizeof(h) + (long long) h.nsections * sizeof(struct section) > st.st_size) {
+		fprintf(stderr, "%s: Truncated section table\n", ds->name);
+		exit(EXIT_FAILURE);
+	}
+
+	ds->mapbits = h.mapbits;
+	ds->metabits = h.metabits;
+	ds->maxn = h.maxn;
+	ds->flags = h.version >= 2 ? h.flags : 0;
+	ds->nsections = h.nsections;
+	ds->len = st.st_size;
+
+	ds->map = mmap(NULL, ds->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (ds->map == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	ds->sections = (struct section *) (ds->map + sizeof(h));
+
+	int i;
+	for (i = 0; i < ds->nsections; i++) {
+		if (ds->sections[i].offset > ds->len || ds->sections[i].length > ds->len - ds->sections[i].offset) {
+			fprintf(stderr, "%s: Section %.*s is past the end of the file\n", ds->name,
+				(int) sizeof(ds->sections[i].name), ds->sections[i].name);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void open_directory(struct dataset *ds) {
+	char meta[strlen(ds->name) + 1 + 4 + 1];
+	sprintf(meta, "%s/meta", ds->name);
+	FILE *f = fopen(meta, "r");
+	if (f == NULL) {
+		perror(meta);
+		exit(EXIT_FAILURE);
+	}
+
+	char s[2000] = "";
+	int version = 0;
+	if (fgets(s, 2000, f) == NULL || sscanf(s, "%d", &version) != 1 || (version != 1 && version != 2)) {
+		fprintf(stderr, "%s: Unknown version %s", meta, s);
+		exit(EXIT_FAILURE);
+	}
+	if (fgets(s, 2000, f) == NULL || sscanf(s, "%d %d %d", &ds->mapbits, &ds->metabits, &ds->maxn) != 3) {
+		fprintf(stderr, "%s: couldn't find size declaration", meta);
+		exit(EXIT_FAILURE);
+	}
+
+	// Version 2 adds a line of flags for how the level files are stored
+	ds->flags = 0;
+	if (version >= 2 && fgets(s, 2000, f) != NULL) {
+		char *tok = strtok(s, " \n");
+
+		for (; tok != NULL; tok = strtok(NULL, " \n")) {
+			if (strcmp(tok, "compressed") == 0) {
+				ds->flags |= DATASET_COMPRESSED;
+			} else if (strcmp(tok, "split") == 0) {
+				ds->flags |= DATASET_SPLIT;
+			} else {
+				fprintf(stderr, "%s: Unknown flag %s\n", meta, tok);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	fclose(f);
+
+	ds->nsections = 0;
+	ds->sections = NULL;
+	ds->map = NULL;
+	ds->len = 0;
+}
+
+struct dataset *dataset_open(char *name) {
+	struct dataset *ds = malloc(sizeof(struct dataset));
+	if (ds == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	ds->name = name;
+
+	if (dataset_iscontainer(name)) {
+		open_container(ds);
+	} else {
+		open_directory(ds);
+	}
+
+	return ds;
+}
+
+void dataset_close(struct dataset *ds) {
+	if (ds->map != NULL) {
+		munmap(ds->map, ds->len);
+	}
+
+	free(ds);
+}
+
+// Map one of the files of the dataset, like "2,14" or "1,0.summary".
+// Returns 0 if the dataset doesn't have it.
+int dataset_map(struct dataset *ds, const char *file, struct mapping *m) {
+	m->data = NULL;
+	m->len = 0;
+	m->map = NULL;
+	m->maplen = 0;
+
+	if (ds->map != NULL) {
+		struct section key;
+		memset(&key, '\0', sizeof(key));
+		strncpy(key.name, file, sizeof(key.name) - 1);
+
+		struct section *s = bsearch(&key, ds->sections, ds->nsections, sizeof(struct section), sectioncmp);
+		if (s == NULL) {
+			return 0;
+		}
+
+		m->data = ds->map + s->offset;
+		m->len = s->length;
+		return 1;
+	}
+
+	char fn[strlen(ds->name) + 1 + strlen(file) + 1];
+	sprintf(fn, "%s/%s", ds->name, file);
+
+	int fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	if (st.st_size > 0) {
+		m->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (m->map == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+
+		m->maplen = st.st_size;
+		m->data = m->map;
+		m->len = st.st_size;
+	}
+
+	close(fd);
+	return 1;
+}
+
+void dataset_unmap(struct mapping *m) {
+	if (m->map != NULL) {
+		munmap(m->map, m->maplen);
+		m->map = NULL;
+	}
+}
+
+// Pass the advice, one of the POSIX_MADV_ constants, along for the pages
+// that hold the specified bytes of the mapping
+void dataset_advise(struct mapping *m, long long offset, long long len, int advice) {
+	if (m->data == NULL || len <= 0) {
+		return;
+	}
+
+	if (offset + len > m->len) {
+		len = m->len - offset;
+	}
+
+	long long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) (m->data + offset) / page * page;
+	uintptr_t end = (uintptr_t) (m->data + offset + len);
+
+	posix_madvise((void *) start, end - start, advice);
+}
+
+// Keep the whole mapping in memory for as long as it is mapped.
+// Returns -1 with errno set, like mlock(), if it can't.
+int dataset_lock(struct mapping *m) {
+	if (m->data == NULL) {
+		return 0;
+	}
+
+	long long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) m->data / page * page;
+	uintptr_t end = (uintptr_t) (m->data + m->len);
+
+	return mlock((void *) start, end - start);
+}
+
+// How many bytes of the mapping are in memory right now
+long long dataset_resident(struct mapping *m) {
+	if (m->data == NULL) {
+		return 0;
+	}
+
+	long long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) m->data / page * page;
+	uintptr_t end = (uintptr_t) (m->data + m->len);
+	long long pages = (end - start + page - 1) / page;
+
+	unsigned char *vec = malloc(pages);
+	if (vec == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (mincore((void *) start, end - start, vec) != 0) {
+		perror("mincore");
+		exit(EXIT_FAILURE);
+	}
+
+	long long resident = 0;
+	long long i;
+	for (i = 0; i < pages; i++) {
+		if (vec[i] & 1) {
+			resident += page;
+		}
+	}
+
+	// The first and last pages may be shared with other sections
+	if (resident > m->len) {
+		resident = m->len;
+	}
+
+	free(vec);
+	return resident;
+}
+
+// Write the meta file for a dataset directory. Datasets without any
+// flags get version 1 so that older readers can still use them.
+void dataset_write_meta(char *dir, int mapbits, int metabits, int maxn, int flags) {
+	char fn[strlen(dir) + 1 + 4 + 1];
+	sprintf(fn, "%s/meta", dir);
+
+	FILE *f = fopen(fn, "w");
+	if (f == NULL) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+
+	if (flags == 0) {
+		fprintf(f, "1\n");
+		fprintf(f, "%d %d %d\n", mapbits, metabits, maxn);
+	} else {
+		fprintf(f, "2\n");
+		fprintf(f, "%d %d %d\n", mapbits, metabits, maxn);
+		char *sep = "";
+
+		if (flags & DATASET_COMPRESSED) {
+			fprintf(f, "%scompressed", sep);
+			sep = " ";
+		}
+		if (flags & DATASET_SPLIT) {
+			fprintf(f, "%ssplit", sep);
+			sep = " ";
+		}
+		fprintf(f, "\n");
+	}
+
+	if (fclose(f) != 0) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Find the last record no greater than key, or the first record if they
+// are all greater, like search(). If there is a block index, only one
+// block of the records themselves needs to be looked at.
+static const unsigned char *search_plain(struct mapping *m, struct mapping *index, const unsigned char *key, int bytes) {
+	long long n = m->len / bytes;
+
+	if (index == NULL || index->len < 8) {
+		return search(key, m->data, n, bytes, bufcmp);
+	}
+
+	long long records = *(const long long *) index->data;
+	long long blocks = (index->len - 8) / bytes;
+
+	if (records < 1 || blocks != (n + records - 1) / records) {
+		return search(key, m->data, n, bytes, bufcmp);
+	}
+
+	const unsigned char *first = search(key, index->data + 8, blocks, bytes, bufcmp);
+	long long block = (first - (index->data + 8)) / bytes;
+
+	long long start = block * records;
+	long long count = records;
+	if (start + count > n) {
+		count = n - start;
+	}
+
+	return search(key, m->data + start * bytes, count, bytes, bufcmp);
+}
+
+// Big-endian 64-bit loads and stores, so that the first bytes of a
+// record can be handled as a number that increases with the records
+
+static unsigned long long load64(const unsigned char *p) {
+	unsigned long long v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static void store64(unsigned char *p, unsigned long long v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
+
+// The deltas in a compressed block, and the fields of a record, are
+// packed most significant bit first. Most of them can be read with a
+// single 8-byte load; only those that are very wide or at the very end
+// of the buffer need to go byte by byte.
+
+unsigned long long getbits(const unsigned char *buf, long long len, long long *bit, int width) {
+	long long byte = *bit >> 3;
+	int off = *bit & 7;
+	unsigned long long v = 0;
+
+	if (width == 0) {
+		return 0;
+	}
+
+	if (width <= 56 && byte + 8 <= len) {
+		*bit += width;
+		return (load64(buf + byte) << off) >> (64 - width);
+	}
+
+	while (width > 0) {
+		off = *bit & 7;
+		int take = 8 - off;
+		if (take > width) {
+			take = width;
+		}
+
+		v = (v << take) | ((buf[*bit >> 3] >> (8 - off - take)) & ((1 << take) - 1));
+		*bit += take;
+		width -= take;
+	}
+
+	return v;
+}
+
+void putbits(unsigned char *buf, long long *bit, int width, unsigned long long v) {
+	while (width > 0) {
+		int off = *bit & 7;
+		int take = 8 - off;
+		if (take > width) {
+			take = width;
+		}
+
+		width -= take;
+		buf[*bit >> 3] |= ((v >> width) & ((1 << take) - 1)) << (8 - off - take);
+		*bit += take;
+	}
+}
+
+// The first 8 bytes of a record, as a number that increases along with the records
+static unsigned long long head(const unsigned char *buf, int headbytes) {
+	unsigned long long v = 0;
+	int i;
+
+	if (headbytes == 8) {
+		return load64(buf);
+	}
+
+	for (i = 0; i < headbytes; i++) {
+		v = (v << 8) | buf[i];
+	}
+
+	return v;
+}
+
+static void unhead(unsigned char *buf, int headbytes, unsigned long long v) {
+	int i;
+
+	if (headbytes == 8) {
+		store64(buf, v);
+		return;
+	}
+
+	for (i = headbytes - 1; i >= 0; i--) {
+		buf[i] = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+static long long block_count(struct level *lv, long long block) {
+	long long n = lv->records - block * lv->per_block;
+	if (n > lv->per_block) {
+		n = lv->per_block;
+	}
+
+	return n;
+}
+
+// Decode the block far enough to include record i of it. Records are
+// decoded lazily because at low zooms only a few of each block are used.
+static void decode_block(struct level *lv, long long block, long long i) {
+	int bytes = lv->bytes;
+	int headbytes = bytes < 8 ? bytes : 8;
+
+	if (block != lv->cached) {
+		long long n = block_count(lv, block);
+		const unsigned long long *offsets = (const unsigned long long *) lv->offsets;
+		const unsigned char *data = lv->map.data + offsets[block];
+
+		lv->width = data[0];
+		lv->deltas = data + 1;
+		lv->tails = lv->deltas + ((n - 1) * lv->width + 7) / 8;
+		lv->avail = lv->map.len - (lv->deltas - lv->map.data);
+		lv->bit = 0;
+
+		memcpy(lv->cache, lv->firsts + block * bytes, bytes);
+		lv->value = head(lv->cache, headbytes);
+		lv->decoded = 1;
+		lv->cached = block;
+	}
+
+	// Work on copies, since the compiler can't tell that writing
+	// the records doesn't change them
+	unsigned char *rec = lv->cache + lv->decoded * bytes;
+	const unsigned char *tail = lv->tails + (lv->decoded - 1) * (bytes - headbytes);
+	unsigned long long value = lv->value;
+	long long bit = lv->bit;
+	long long j;
+
+	for (j = lv->decoded; j <= i; j++) {
+		value += getbits(lv->deltas, lv->avail, &bit, lv->width);
+		unhead(rec, headbytes, value);
+		if (bytes > headbytes) {
+			memcpy(rec + headbytes, tail, bytes - headbytes);
+		}
+
+		rec += bytes;
+		tail += bytes - headbytes;
+	}
+
+	lv->value = value;
+	lv->bit = bit;
+	lv->decoded = j;
+}
+
+static void open_blocks(struct dataset *ds, char *fn, struct level *lv) {
+	struct block_header h;
+	if (lv->map.len < sizeof(h)) {
+		if (lv->map.len == 0) {
+			lv->records = 0;
+			return;
+		}
+
+		fprintf(stderr, "%s/%s: Truncated block header\n", ds->name, fn);
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(&h, lv->map.data, sizeof(h));
+	if (memcmp(h.magic, BLOCK_MAGIC, sizeof(h.magic)) != 0 || h.bytes != lv->bytes || h.per_block < 1 ||
+	    h.records < 0 || h.blocks != (h.records + h.per_block - 1) / h.per_block) {
+		fprintf(stderr, "%s/%s: Not a compressed level file\n", ds->name, fn);
+		exit(EXIT_FAILURE);
+	}
+
+	long long tables = sizeof(h) + (h.blocks + 1) * sizeof(unsigned long long) + h.blocks * h.bytes;
+	if (tables > lv->map.len) {
+		fprintf(stderr, "%s/%s: Truncated block tables\n", ds->name, fn);
+		exit(EXIT_FAILURE);
+	}
+
+	lv->compressed = 1;
+	lv->records = h.records;
+	lv->per_block = h.per_block;
+	lv->blocks = h.blocks;
+	lv->offsets = lv->map.data + sizeof(h);
+	lv->firsts = lv->offsets + (h.blocks + 1) * sizeof(unsigned long long);
+	lv->cached = -1;
+
+	const unsigned long long *offsets = (const unsigned long long *) lv->offsets;
+	if (offsets[h.blocks] > lv->map.len) {
+		fprintf(stderr, "%s/%s: Truncated blocks\n", ds->name, fn);
+		exit(EXIT_FAILURE);
+	}
+
+	lv->cache = malloc(h.per_block * h.bytes);
+	if (lv->cache == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// The size of the records as they are stored in the level file,
+// which leaves out the metadata if it is in a column of its own
+int dataset_bytes(struct dataset *ds, int components, int z_lookup) {
+	if (ds->flags & DATASET_SPLIT) {
+		return bytesfor(ds->mapbits, 0, components, z_lookup);
+	}
+
+	return bytesfor(ds->mapbits, ds->metabits, components, z_lookup);
+}
+
+// Open the level file of the dataset for the specified number of
+// components and lookup zoom. Returns 0 if the dataset doesn't have it.
+int level_open(struct dataset *ds, int components, int z_lookup, struct level *lv) {
+	char fn[11 + 1 + 11 + 1];
+	char otherfn[11 + 1 + 11 + 6 + 1];
+
+	if (components == 1) {
+		sprintf(fn, "1,0");
+	} else {
+		sprintf(fn, "%d,%d", components, z_lookup);
+	}
+
+	lv->bytes = dataset_bytes(ds, components, z_lookup);
+	lv->indexed = 0;
+	lv->split = 0;
+	lv->full = NULL;
+	lv->compressed = 0;
+	lv->cache = NULL;
+
+	if (!dataset_map(ds, fn, &lv->map)) {
+		return 0;
+	}
+
+	if (ds->flags & DATASET_COMPRESSED) {
+		open_blocks(ds, fn, lv);
+	} else {
+		lv->records = lv->map.len / lv->bytes;
+
+		// Only containers have block indexes
+		sprintf(otherfn, "%s.index", fn);
+		lv->indexed = dataset_map(ds, otherfn, &lv->index);
+	}
+
+	if (ds->flags & DATASET_SPLIT) {
+		lv->split = 1;
+		lv->metabits = ds->metabits;
+		lv->metabytes = (ds->metabits + 7) / 8;
+		lv->fullbytes = bytesfor(ds->mapbits, ds->metabits, components, z_lookup);
+		lv->geobits = geometry_bits(ds->mapbits, components, z_lookup);
+
+		sprintf(otherfn, "%s.meta", fn);
+		if (!dataset_map(ds, otherfn, &lv->meta) || lv->meta.len != lv->records * lv->metabytes) {
+			fprintf(stderr, "%s/%s: Missing or doesn't match %s\n", ds->name, otherfn, fn);
+			exit(EXIT_FAILURE);
+		}
+
+		lv->full = malloc(lv->fullbytes);
+		if (lv->full == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return 1;
+}
+
+// The record with the specified number, which must be less than lv->records
+const unsigned char *level_record(struct level *lv, long long i) {
+	if (!lv->compressed) {
+		return lv->map.data + i * lv->bytes;
+	}
+
+	long long block = i / lv->per_block;
+	long long j = i - block * lv->per_block;
+
+	if (j == 0) {
+		return lv->firsts + block * lv->bytes;
+	}
+
+	if (block != lv->cached || j >= lv->decoded) {
+		// A few at a time, since most reads are sequential
+		long long upto = j | 15;
+		long long n = block_count(lv, block);
+		if (upto >= n) {
+			upto = n - 1;
+		}
+
+		decode_block(lv, block, upto);
+	}
+
+	return lv->cache + j * lv->bytes;
+}
+
+// The number of the last record no greater than key, or 0 if they
+// are all greater, like search(). Sets gSortBytes for the comparison.
+long long level_search(struct level *lv, const unsigned char *key) {
+	int bytes = lv->bytes;
+	gSortBytes = bytes;
+
+	if (!lv->compressed) {
+		const unsigned char *found = search_plain(&lv->map, lv->indexed ? &lv->index : NULL, key, bytes);
+		return (found - lv->map.data) / bytes;
+	}
+
+	if (lv->blocks == 0) {
+		return 0;
+	}
+
+	const unsigned char *first = search(key, lv->firsts, lv->blocks, bytes, bufcmp);
+	long long block = (first - lv->firsts) / bytes;
+
+	long long n = block_count(lv, block);
+	decode_block(lv, block, n - 1);
+
+	const unsigned char *found = search(key, lv->cache, n, bytes, bufcmp);
+	return block * lv->per_block + (found - lv->cache) / bytes;
+}
+
+// The first record of the level whose first 64 bits are at or after key.
+// The search finds the last record no greater than what it is given, so it
+// is given the greatest record that comes before key, in case some records
+// are equal to key itself.
+long long level_find(struct level *lv, unsigned long long key) {
+	unsigned char buf[lv->bytes];
+	int i;
+
+	if (lv->records == 0 || key == 0) {
+		return 0;
+	}
+
+	key--;
+	for (i = 0; i < lv->bytes; i++) {
+		buf[i] = i < 8 ? key >> (56 - 8 * i) : 0xFF;
+	}
+
+	long long found = level_search(lv, buf);
+	if (memcmp(level_record(lv, found), buf, lv->bytes) <= 0) {
+		found++;
+	}
+
+	return found;
+}
+
+// The metadata of a record of a split level
+unsigned long long level_meta(struct level *lv, long long i) {
+	const unsigned char *p = lv->meta.data + i * lv->metabytes;
+	unsigned long long v = 0;
+	int j;
+
+	for (j = 0; j < lv->metabytes; j++) {
+		v = (v << 8) | p[j];
+	}
+
+	return v;
+}
+
+// The record with the specified number, with its metadata in it
+// even if the level is split. Good until the next call, like level_record().
+const unsigned char *level_full_record(struct level *lv, long long i) {
+	const unsigned char *rec = level_record(lv, i);
+
+	if (!lv->split) {
+		return rec;
+	}
+
+	// The metadata goes right after the last bit of the geometry,
+	// where the stored record only has zeros for padding
+
+	memset(lv->full, '\0', lv->fullbytes);
+	memcpy(lv->full, rec, lv->bytes);
+
+	long long bit = lv->geobits;
+	putbits(lv->full, &bit, lv->metabits, level_meta(lv, i));
+	return lv->full;
+}
+
+// Pass the advice along for the parts of the level that hold records first
+// through last, and for their entries in the metadata column if meta is set
+void level_advise(struct level *lv, long long first, long long last, int advice, int meta) {
+	if (first > last || lv->records == 0) {
+		return;
+	}
+
+	if (lv->compressed) {
+		const unsigned long long *offsets = (const unsigned long long *) lv->offsets;
+		long long b1 = first / lv->per_block;
+		long long b2 = last / lv->per_block;
+
+		dataset_advise(&lv->map, offsets[b1], offsets[b2 + 1] - offsets[b1], advice);
+	} else {
+		dataset_advise(&lv->map, first * lv->bytes, (last - first + 1) * lv->bytes, advice);
+	}
+
+	if (lv->split && meta) {
+		dataset_advise(&lv->meta, first * lv->metabytes, (last - first + 1) * lv->metabytes, advice);
+	}
+}
+
+void level_close(struct level *lv) {
+	if (lv->indexed) {
+		dataset_unmap(&lv->index);
+	}
+	if (lv->split) {
+		dataset_unmap(&lv->meta);
+	}
+	dataset_unmap(&lv->map);
+	free(lv->cache);
+	free(lv->full);
+}
+
+// Move the metadata of the sorted level file fname out into fname.meta,
+// as a column of big-endian numbers with one for each record, leaving
+// just the coordinates in fname. Since the metadata comes last in each
+// record, the shortened records are still in order.
+void level_split(char *fname, int mapbits, int metabits, int components, int z_lookup) {
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned char *map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	char tmp[strlen(fname) + 4 + 1];
+	char mname[strlen(fname) + 5 + 1];
+	sprintf(tmp, "%s.tmp", fname);
+	sprintf(mname, "%s.meta", fname);
+
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	FILE *m = fopen(mname, "wb");
+	if (m == NULL) {
+		perror(mname);
+		exit(EXIT_FAILURE);
+	}
+
+	int bytes = bytesfor(mapbits, metabits, components, z_lookup);
+	int geobits = geometry_bits(mapbits, components, z_lookup);
+	int geobytes = (geobits + 7) / 8;
+	int metabytes = (metabits + 7) / 8;
+	long long n = st.st_size / bytes;
+	long long i;
+
+	for (i = 0; i < n; i++) {
+		const unsigned char *rec = map + i * bytes;
+		unsigned char geo[geobytes];
+		unsigned char meta[metabytes];
+
+		memcpy(geo, rec, geobytes);
+		if (geobits % 8 != 0) {
+			geo[geobytes - 1] &= 0xFF << (8 - geobits % 8);
+		}
+
+		long long bit = geobits;
+		unsigned long long v = getbits(rec, bytes, &bit, metabits);
+		int j;
+		for (j = metabytes - 1; j >= 0; j--) {
+			meta[j] = v & 0xFF;
+			v >>= 8;
+		}
+
+		if (fwrite(geo, geobytes, 1, f) != 1) {
+			perror(tmp);
+			exit(EXIT_FAILURE);
+		}
+		if (metabytes > 0 && fwrite(meta, metabytes, 1, m) != 1) {
+			perror(mname);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fclose(f) != 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	if (fclose(m) != 0) {
+		perror(mname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(tmp, fname) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (map != NULL) {
+		munmap((void *) map, st.st_size);
+	}
+	close(fd);
+}
+
+// Rewrite the sorted level file fname in blocks of BLOCK_RECORDS records.
+// Within a block, each record after the first is stored as the difference
+// of its first 8 bytes from those of the record before, in just enough
+// bits for the largest difference, plus the rest of its bytes as they are.
+// The first record of each block is kept whole in a table of its own,
+// so that any block can be found by binary search and decoded by itself.
+void level_compress(char *fname, int bytes) {
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned char *map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	char tmp[strlen(fname) + 4 + 1];
+	sprintf(tmp, "%s.tmp", fname);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+
+	struct block_header h;
+	memset(&h, '\0', sizeof(h));
+	memcpy(h.magic, BLOCK_MAGIC, sizeof(h.magic));
+	h.records = st.st_size / bytes;
+	h.bytes = bytes;
+	h.per_block = BLOCK_RECORDS;
+	h.blocks = (h.records + h.per_block - 1) / h.per_block;
+
+	unsigned long long *offsets = malloc((h.blocks + 1) * sizeof(unsigned long long));
+	unsigned char *buf = malloc(1 + h.per_block * bytes);
+	if (offsets == NULL || buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	// The offsets go in after the blocks are written and their sizes are known
+
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(offsets, sizeof(unsigned long long), h.blocks + 1, f);
+
+	long long block;
+	for (block = 0; block < h.blocks; block++) {
+		fwrite(map + block * h.per_block * bytes, bytes, 1, f);
+	}
+
+	int headbytes = bytes < 8 ? bytes : 8;
+	long long offset = ftell(f);
+
+	for (block = 0; block < h.blocks; block++) {
+		const unsigned char *recs = map + block * h.per_block * bytes;
+		long long n = h.records - block * h.per_block;
+		if (n > h.per_block) {
+			n = h.per_block;
+		}
+
+		unsigned long long most = 0;
+		long long i;
+		for (i = 1; i < n; i++) {
+			unsigned long long d = head(recs + i * bytes, headbytes) - head(recs + (i - 1) * bytes, headbytes);
+			if (d > most) {
+				most = d;
+			}
+		}
+
+		int width = 0;
+		while (width < 64 && (most >> width) != 0) {
+			width++;
+		}
+
+		long long len = 1 + ((n - 1) * width + 7) / 8;
+		memset(buf, '\0', len);
+		buf[0] = width;
+
+		long long bit = 0;
+		for (i = 1; i < n; i++) {
+			unsigned long long d = head(recs + i * bytes, headbytes) - head(recs + (i - 1) * bytes, headbytes);
+			putbits(buf + 1, &bit, width, d);
+		}
+		for (i = 1; i < n; i++) {
+			memcpy(buf + len + (i - 1) * (bytes - headbytes), recs + i * bytes + headbytes, bytes - headbytes);
+		}
+		len += (n - 1) * (bytes - headbytes);
+
+		offsets[block] = offset;
+		if (fwrite(buf, len, 1, f) != 1) {
+			perror(tmp);
+			exit(EXIT_FAILURE);
+		}
+		offset += len;
+	}
+	offsets[h.blocks] = offset;
+
+	if (fseek(f, sizeof(h), SEEK_SET) != 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	fwrite(offsets, sizeof(unsigned long long), h.blocks + 1, f);
+
+	if (fclose(f) != 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(tmp, fname) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (map != NULL) {
+		munmap((void *) map, st.st_size);
+	}
+	close(fd);
+	free(offsets);
+	free(buf);
+}
+
+// Finish the sorted level file fname once all its records are written:
+// summarize it, then split and compress it as the flags of the dataset say
+void level_finish(char *fname, int mapbits, int metabits, int components, int z_lookup, int flags) {
+	summary_write(fname, mapbits, metabits, components, z_lookup);
+
+	if (flags & DATASET_SPLIT) {
+		level_split(fname, mapbits, metabits, components, z_lookup);
+	}
+	if (flags & DATASET_COMPRESSED) {
+		level_compress(fname, bytesfor(mapbits, (flags & DATASET_SPLIT) ? 0 : metabits, components, z_lookup));
+	}
+}
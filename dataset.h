@@ -0,0 +1,137 @@
+// A dataset is either a directory, with a text meta file and a file for
+// each legs,level, or a single container file holding the same things
+// as sections. Either way, its files are read by mapping them by name.
+
+struct section {
+	char name[32];
+	unsigned long long offset;
+	unsigned long long length;
+};
+
+#define DATASET_COMPRESSED 1 // level files are in blocks, see level_compress()
+#define DATASET_SPLIT 2 // metadata is in a column of its own, see level_split()
+
+struct dataset {
+	char *name;
+	int mapbits;
+	int metabits;
+	int maxn;
+	int flags;
+
+	// Only for containers
+	int nsections;
+	struct section *sections;
+	unsigned char *map;
+	size_t len;
+};
+
+struct mapping {
+	const unsigned char *data;
+	long long len;
+
+	void *map;	// what to unmap, if anything
+	size_t maplen;
+};
+
+struct dataset *dataset_open(char *name);
+void dataset_close(struct dataset *ds);
+int dataset_iscontainer(char *name);
+
+int dataset_map(struct dataset *ds, const char *file, struct mapping *m);
+void dataset_unmap(struct mapping *m);
+
+void dataset_advise(struct mapping *m, long long offset, long long len, int advice);
+int dataset_lock(struct mapping *m);
+long long dataset_resident(struct mapping *m);
+
+void dataset_write_meta(char *dir, int mapbits, int metabits, int maxn, int flags);
+int dataset_bytes(struct dataset *ds, int components, int z_lookup);
+
+// The sorted records of one legs,level file, by number, whichever way
+// they are stored. Each open level decodes one block at a time into
+// its own buffer, so a record pointer is only good until the next call.
+
+struct level {
+	struct mapping map;
+	struct mapping index;
+	int indexed;
+	int bytes;
+	long long records;
+
+	// Only for split levels: the metadata column, and
+	// room to put the metadata back into a whole record
+	int split;
+	struct mapping meta;
+	int metabits;
+	int metabytes;
+	int fullbytes;
+	int geobits;
+	unsigned char *full;
+
+	// Only for compressed levels
+	int compressed;
+	long long per_block;
+	long long blocks;
+	const unsigned char *offsets;
+	const unsigned char *firsts;
+	unsigned char *cache;
+	long long cached;	// which block is in the cache
+	long long decoded;	// how many of its records so far
+
+	// Where decoding of the cached block is up to
+	int width;
+	const unsigned char *deltas;
+	const unsigned char *tails;
+	long long avail;
+	long long bit;
+	unsigned long long value;
+};
+
+int level_open(struct dataset *ds, int components, int z_lookup, struct level *lv);
+const unsigned char *level_record(struct level *lv, long long i);
+long long level_search(struct level *lv, const unsigned char *key);
+long long level_find(struct level *lv, unsigned long long key);
+unsigned long long level_meta(struct level *lv, long long i);
+const unsigned char *level_full_record(struct level *lv, long long i);
+void level_advise(struct level *lv, long long first, long long last, int advice, int meta);
+void level_close(struct level *lv);
+
+void level_split(char *fname, int mapbits, int metabits, int components, int z_lookup);
+void level_compress(char *fname, int bytes);
+void level_finish(char *fname, int mapbits, int metabits, int components, int z_lookup, int flags);
+
+// Bit fields, most significant bit first, from a buffer len bytes long
+unsigned long long getbits(const unsigned char *buf, long long len, long long *bit, int width);
+void putbits(unsigned char *buf, long long *bit, int width, unsigned long long v);
+
+// Containers
+
+#define CONTAINER_MAGIC "datamaps"
+#define INDEX_BLOCK 4096 // bytes of records for each entry in a block index
+
+struct container_header {
+	char magic[8];
+	int version;
+	int mapbits;
+	int metabits;
+	int maxn;
+	int nsections;
+	int flags;
+};
+
+#define BLOCK_MAGIC "dmblk01\n"
+#define BLOCK_RECORDS 128
+
+// A compressed level file starts with this, then blocks + 1 64-bit offsets
+// of the blocks within the file, then the first record of each block.
+// Each block is the width of its deltas in one byte, the deltas of the
+// first 8 bytes of its records after the first, bit-packed, and then the
+// rest of the bytes of its records after the first.
+
+struct block_header {
+	char magic[8];
+	long long records;
+	int bytes;
+	int per_block;
+	long long blocks;
+};
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "dedup.h"
+#include "writer.h"
+
+// 64-bit FNV-1a. Tiles with the same hash are still compared
+// byte for byte before one is taken for the other.
+unsigned long long dedup_hash(const void *data, size_t len) {
+	const unsigned char *p = data;
+	unsigned long long h = 14695981039346656037ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+// Whether the file has exactly these contents
+static int same(char *fname, const void *data, size_t len) {
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		return 0;
+	}
+
+	char *buf = malloc(len + 1);
+	if (buf == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t n = fread(buf, 1, len + 1, f);
+	int ret = n == len && memcmp(buf, data, len) == 0;
+
+	free(buf);
+	fclose(f);
+	return ret;
+}
+
+// Links to one blob are kept under the 65000 that ext4 allows, and
+// the same contents go into another blob after that
+#ifndef DEDUP_MAXLINKS
+#define DEDUP_MAXLINKS 60000
+#endif
+
+// Whether the blob can't take another link
+static int full(char *blob) {
+	struct stat st;
+	return stat(blob, &st) == 0 && st.st_nlink >= DEDUP_MAXLINKS;
+}
+
+// Make sure a blob with these contents exists, starting the search at
+// *collision, and put its name in blob and its counter in *collision.
+// Returns 1 if it was already there.
+static int store(char *outdir, char *filetype, const void *data, size_t len, char *blob, int *collision) {
+	unsigned long long h = dedup_hash(data, len);
+
+	sprintf(blob, "%s/.blobs", outdir);
+	mkdir(blob, 0777);
+	sprintf(blob, "%s/.blobs/%02llx", outdir, h >> 56);
+	mkdir(blob, 0777);
+
+	// Different tiles with the same hash and length, and full
+	// blobs of the same tile, are told apart by a counter after them
+
+	for (; ; (*collision)++) {
+		sprintf(blob, "%s/.blobs/%02llx/%016llx-%zu-%d.%s", outdir, h >> 56, h, len, *collision, filetype);
+
+		if (same(blob, data, len) && !full(blob)) {
+			return 1;
+		}
+		if (access(blob, F_OK) == 0) {
+			continue;
+		}
+
+		char tmp[strlen(blob) + 50];
+		writer_tempname(tmp, blob);
+
+		FILE *f = fopen(tmp, "wb");
+		if (f == NULL) {
+			perror(tmp);
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(data, 1, len, f) != len || fclose(f) != 0) {
+			perror(tmp);
+			exit(EXIT_FAILURE);
+		}
+
+		// Someone else may have stored the same thing meanwhile
+		int ret = link(tmp, blob);
+		int err = errno;
+		unlink(tmp);
+
+		if (ret == 0) {
+			return 0;
+		}
+		if (err != EEXIST) {
+			errno = err;
+			perror(blob);
+			exit(EXIT_FAILURE);
+		}
+
+		if (same(blob, data, len) && !full(blob)) {
+			return 1;
+		}
+	}
+}
+
+// Write the tile as a link to the blob with its contents,
+// replacing whatever was at path before
+void dedup_write(char *outdir, char *path, char *filetype, const void *data, size_t len, struct dedup_stats *st) {
+	char blob[strlen(outdir) + 100];
+	int collision = 0;
+	int found;
+
+	char tmp[strlen(path) + 50];
+	writer_tempname(tmp, path);
+
+	// The blob can still fill up between store() and link()
+	// when other threads or processes are linking to it too
+	while (1) {
+		found = store(outdir, filetype, data, len, blob, &collision);
+
+		if (link(blob, tmp) == 0) {
+			break;
+		}
+		if (errno != EMLINK) {
+			perror(tmp);
+			exit(EXIT_FAILURE);
+		}
+
+		collision++;
+	}
+	if (rename(tmp, path) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	// If path was already a link to the same blob, rename()
+	// leaves both names in place
+	unlink(tmp);
+
+	st->tiles++;
+	st->bytes += len;
+	if (found) {
+		st->saved += len;
+	} else {
+		st->distinct++;
+	}
+}
+
+void dedup_report(struct dedup_stats *st) {
+	fprintf(stderr, "%lld tiles stored as %lld distinct ones: %lld of %lld bytes saved (%.1f%%)\n",
+		st->tiles, st->distinct, st->saved, st->bytes,
+		st->bytes > 0 ? 100.0 * st->saved / st->bytes : 0.0);
+}
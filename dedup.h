@@ -0,0 +1,14 @@
+// Storing identical tiles only once. In a directory, every tile is a
+// hard link to a file in .blobs named for its contents. In MBTiles, the
+// images table holds each distinct tile and the map table points to it.
+
+struct dedup_stats {
+	long long tiles;
+	long long distinct;	// tiles whose contents weren't there yet
+	long long bytes;	// of all the tiles
+	long long saved;	// of the ones that were already there
+};
+
+unsigned long long dedup_hash(const void *data, size_t len);
+void dedup_write(char *outdir, char *path, char *filetype, const void *data, size_t len, struct dedup_stats *st);
+void dedup_report(struct dedup_stats *st);
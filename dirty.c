@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include "util.h"
+#include "graphics.h"
+#include "clip.h"
+#include "dataset.h"
+#include "occupancy.h"
+#include "draw.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-t transparency] [-agmsw] [-B zoom:level:ramp] [-M latitude] [-l lineramp] [-z max] [-Z min] [-k metatile] merged new ...\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+// The tiles touched at one zoom, as quadkeys, with duplicates
+// squeezed out whenever the list has doubled since the last time
+
+struct zoom {
+	unsigned long long *keys;
+	long long nkeys;
+	long long nalloc;
+	long long squeezed;
+};
+
+static int keycmp(const void *v1, const void *v2) {
+	const unsigned long long *k1 = v1;
+	const unsigned long long *k2 = v2;
+
+	if (*k1 < *k2) {
+		return -1;
+	} else if (*k1 > *k2) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+static void squeeze(struct zoom *zm) {
+	long long i, out = 0;
+
+	qsort(zm->keys, zm->nkeys, sizeof(unsigned long long), keycmp);
+
+	for (i = 0; i < zm->nkeys; i++) {
+		if (out == 0 || zm->keys[out - 1] != zm->keys[i]) {
+			zm->keys[out++] = zm->keys[i];
+		}
+	}
+
+	zm->nkeys = out;
+	zm->squeezed = out;
+}
+
+static void addtile(struct zoom *zm, int z, long long x, long long y) {
+	if (x < 0 || y < 0 || x >= (1LL << z) || y >= (1LL << z)) {
+		return;
+	}
+
+	if (zm->nkeys >= zm->nalloc) {
+		if (zm->nkeys > 2 * zm->squeezed + 1024) {
+			squeeze(zm);
+		}
+
+		if (zm->nkeys >= zm->nalloc) {
+			zm->nalloc = zm->nalloc * 2 + 1024;
+			zm->keys = realloc(zm->keys, zm->nalloc * sizeof(unsigned long long));
+			if (zm->keys == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	zm->keys[zm->nkeys++] = zxy2key(z, x, y);
+}
+
+// Distance from a point to the tile at tx, ty, in tiles
+static double point_tile_dist(double x, double y, long long tx, long long ty) {
+	double dx = 0, dy = 0;
+
+	if (x < tx) {
+		dx = tx - x;
+	} else if (x > tx + 1) {
+		dx = x - (tx + 1);
+	}
+
+	if (y < ty) {
+		dy = ty - y;
+	} else if (y > ty + 1) {
+		dy = y - (ty + 1);
+	}
+
+	return sqrt(dx * dx + dy * dy);
+}
+
+static double point_segment_dist(double x, double y, double x1, double y1, double x2, double y2) {
+	double dx = x2 - x1, dy = y2 - y1;
+	double len2 = dx * dx + dy * dy;
+	double t = 0;
+
+	if (len2 > 0) {
+		t = ((x - x1) * dx + (y - y1) * dy) / len2;
+		if (t < 0) {
+			t = 0;
+		} else if (t > 1) {
+			t = 1;
+		}
+	}
+
+	double px = x1 + t * dx - x, py = y1 + t * dy - y;
+	return sqrt(px * px + py * py);
+}
+
+// Distance from a segment to the tile at tx, ty, in tiles
+static double segment_tile_dist(double x1, double y1, double x2, double y2, long long tx, long long ty) {
+	double cx1 = x1, cy1 = y1, cx2 = x2, cy2 = y2;
+
+	if (clip(&cx1, &cy1, &cx2, &cy2, tx, ty, tx + 1, ty + 1)) {
+		return 0;
+	}
+
+	double d = point_tile_dist(x1, y1, tx, ty);
+	double d2 = point_tile_dist(x2, y2, tx, ty);
+	if (d2 < d) {
+		d = d2;
+	}
+
+	int i;
+	for (i = 0; i < 4; i++) {
+		d2 = point_segment_dist(tx + (i & 1), ty + (i >> 1), x1, y1, x2, y2);
+		if (d2 < d) {
+			d = d2;
+		}
+	}
+
+	return d;
+}
+
+// Add the tiles the point is in or can reach into
+static void add_point(struct zoom *zm, int z, long long wx, long long wy, double reach) {
+	int shift = 32 - z;
+	long long tx = wx >> shift, ty = wy >> shift;
+
+	addtile(zm, z, tx, ty);
+
+	if (reach <= 0) {
+		return;
+	}
+
+	// In tiles, from here on
+	double x = (double) wx / (1LL << shift);
+	double y = (double) wy / (1LL << shift);
+	reach /= tilesize;
+
+	long long r = ceil(reach);
+	long long dx, dy;
+
+	for (dx = -r; dx <= r; dx++) {
+		for (dy = -r; dy <= r; dy++) {
+			if ((dx != 0 || dy != 0) && point_tile_dist(x, y, tx + dx, ty + dy) <= reach) {
+				addtile(zm, z, tx + dx, ty + dy);
+			}
+		}
+	}
+}
+
+struct segment {
+	struct zoom *zm;
+	int z;
+	double fx0, fy0, fx1, fy1;
+	double reach;
+};
+
+// A tile the segment passes through, and the ones beside it that the
+// width of the line reaches into
+static void segment_tile(void *arg, long long x, long long y) {
+	struct segment *sg = arg;
+	long long r = ceil(sg->reach);
+	long long nx, ny;
+
+	addtile(sg->zm, sg->z, x, y);
+
+	for (nx = x - r; nx <= x + r; nx++) {
+		for (ny = y - r; ny <= y + r; ny++) {
+			if ((nx != x || ny != y) && segment_tile_dist(sg->fx0, sg->fy0, sg->fx1, sg->fy1, nx, ny) <= sg->reach) {
+				addtile(sg->zm, sg->z, nx, ny);
+			}
+		}
+	}
+}
+
+// Add the tiles the segment passes through, as enumerate -c finds them,
+// and the ones beside them that the width of the line reaches into
+static void add_segment(struct zoom *zm, int z, long long x0, long long y0, long long x1, long long y1, double reach) {
+	int shift = 32 - z;
+	struct segment sg;
+
+	sg.zm = zm;
+	sg.z = z;
+	sg.fx0 = (double) x0 / (1LL << shift);
+	sg.fy0 = (double) y0 / (1LL << shift);
+	sg.fx1 = (double) x1 / (1LL << shift);
+	sg.fy1 = (double) y1 / (1LL << shift);
+	sg.reach = reach / tilesize;
+
+	supercover(shift, x0, y0, x1, y1, segment_tile, &sg);
+}
+
+// Add the tiles at each zoom that drawing the record changes
+static void add_record(struct zoom *zooms, int minzoom, int maxzoom, int mapbits, int components, int z_lookup, unsigned int *x, unsigned int *y, unsigned long long meta) {
+	double lat, lon;
+	tile2latlon(x[0], y[0], 32, &lat, &lon);
+
+	int z;
+	for (z = minzoom; z <= maxzoom; z++) {
+		struct zoom *zm = &zooms[z];
+
+		// When overzoomed, render moves each point by noise within
+		// the resolution of the file, so it can reach that much further
+		double noise = 0;
+		if (z >= mapbits / 2 - 8) {
+			noise = tilesize * exp(log(2.0) * (z - mapbits / 2));
+		}
+
+		if (components == 1) {
+			double reach = draw_reach(1, z, lat, meta);
+			add_point(zm, z, x[0], y[0], reach > 0 ? reach + noise : 0);
+			continue;
+		}
+
+		// Lines from more than 8 levels deeper are too small to draw
+		if (z_lookup >= z + 9) {
+			continue;
+		}
+
+		double reach = draw_reach(components, z, lat, meta) + noise;
+		int k;
+
+		for (k = 1; k < components; k++) {
+			long long xk1 = x[k - 1];
+			long long xk = x[k];
+
+			// Segments that cross the antimeridian are drawn
+			// from both sides, as process() does
+			if (xk - xk1 >= (1LL << 31)) {
+				add_segment(zm, z, xk1, y[k - 1], xk - (1LL << 32), y[k], reach);
+				add_segment(zm, z, xk1 + (1LL << 32), y[k - 1], xk, y[k], reach);
+			} else if (xk1 - xk >= (1LL << 31)) {
+				add_segment(zm, z, xk1 - (1LL << 32), y[k - 1], xk, y[k], reach);
+				add_segment(zm, z, xk1, y[k - 1], xk + (1LL << 32), y[k], reach);
+			} else {
+				add_segment(zm, z, xk1, y[k - 1], xk, y[k], reach);
+			}
+		}
+	}
+}
+
+// A point, kept in the order of the level, at the zoom given
+static void addpoint(struct zoom *zm, int z, unsigned int x, unsigned int y) {
+	if (zm->nkeys >= zm->nalloc) {
+		zm->nalloc = zm->nalloc * 2 + 1024;
+		zm->keys = realloc(zm->keys, zm->nalloc * sizeof(unsigned long long));
+		if (zm->keys == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	zm->keys[zm->nkeys++] = zxy2key(z, (unsigned long long) x >> (32 - z), (unsigned long long) y >> (32 - z));
+}
+
+// Below dot_base, render draws every step-th point of the level by its
+// index, so the points added ahead of a tile change which of its own
+// points are drawn, unless there are a multiple of the step of them.
+// Those tiles are found from the tiles of the merged dataset at zs,
+// and the new points sorted by their tiles at the same zoom.
+static void shifted(struct zoom *zooms, int minzoom, int zs, struct dataset *merged, struct zoom *added) {
+	qsort(added->keys, added->nkeys, sizeof(unsigned long long), keycmp);
+
+	struct occupancy *occ = occupancy_open(merged);
+	const unsigned long long *entries;
+	unsigned long long *built = NULL;
+	long long tiles;
+	int ozoom;
+
+	if (occ != NULL && occ->zoom >= zs) {
+		entries = occ->entries;
+		tiles = occ->tiles;
+		ozoom = occ->zoom;
+	} else {
+		built = occupancy_build(merged, zs, &tiles);
+		entries = built;
+		ozoom = zs;
+	}
+
+	int z;
+	for (z = minzoom; z <= zs; z++) {
+		int step = draw_step(z);
+		if (step <= 1) {
+			continue;
+		}
+
+		long long t, before = 0;
+		unsigned long long prev = ~0ULL;
+
+		for (t = 0; t < tiles; t++) {
+			unsigned long long key = entries[2 * t] >> 2 * (ozoom - z);
+			if (key == prev) {
+				continue;
+			}
+			prev = key;
+
+			// How many new points come before the tile
+			unsigned long long start = key << 2 * (zs - z);
+			while (before < added->nkeys && added->keys[before] < start) {
+				before++;
+			}
+
+			if (before % step != 0) {
+				unsigned int x, y;
+				key2zxy(key, z, &x, &y);
+
+				// Clouds read the points of the tiles around them too
+				if (circle > 0) {
+					add_point(&zooms[z], z, ((long long) x << (32 - z)) + (1LL << (31 - z)),
+						  ((long long) y << (32 - z)) + (1LL << (31 - z)), tilesize);
+				} else {
+					addtile(&zooms[z], z, x, y);
+				}
+			}
+		}
+	}
+
+	if (occ != NULL) {
+		occupancy_close(occ);
+	}
+	free(built);
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	int maxzoom = -1;
+	int minzoom = 0;
+	int metatile = 1;
+
+	while ((i = getopt(argc, argv, "ab:B:c:C:e:gG:k:l:L:mM:O:p:sS:t:T:wx:z:Z:")) != -1) {
+		switch (i) {
+		case 'z':
+			maxzoom = atoi(optarg);
+			break;
+
+		case 'Z':
+			minzoom = atoi(optarg);
+			break;
+
+		case 'k':
+			metatile = atoi(optarg);
+			if (metatile < 1 || (metatile & (metatile - 1)) != 0) {
+				fprintf(stderr, "Metatile size %s is not a power of 2\n", optarg);
+				usage(argv);
+			}
+			break;
+
+		default:
+			switch (draw_option(i, optarg)) {
+			case 0:
+				fprintf(stderr, "Unknown option %c\n", i);
+				usage(argv);
+				break;
+
+			case -1:
+				usage(argv);
+			}
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv);
+	}
+
+	char *name = argv[optind++];
+	struct dataset *merged = dataset_open(name);
+
+	if (maxzoom < 0) {
+		maxzoom = merged->mapbits / 2 - 8;
+	}
+
+	if (maxzoom < 0) {
+		maxzoom = 0;
+	}
+	if (maxzoom > 30) {
+		maxzoom = 30;
+	}
+	if (minzoom > maxzoom) {
+		fprintf(stderr, "Minimum zoom %d is above maximum zoom %d\n", minzoom, maxzoom);
+		usage(argv);
+	}
+
+	struct zoom zooms[maxzoom + 1];
+	memset(zooms, 0, sizeof(zooms));
+
+	// The deepest zoom at which only some of the points are drawn
+	int zs = maxzoom;
+	if (zs > dot_base - 1) {
+		zs = dot_base - 1;
+	}
+
+	struct zoom added;
+	memset(&added, 0, sizeof(added));
+
+	for (; optind < argc; optind++) {
+		char *fname = argv[optind];
+		struct dataset *ds = dataset_open(fname);
+		int wantmeta = ds->metabits > 0 && (metabrush || minmeta > 0 || maxmeta < LLONG_MAX);
+
+		int z_lookup;
+		for (z_lookup = 0; z_lookup <= ds->mapbits / 2; z_lookup++) {
+			int components;
+
+			for (components = 1; components <= ds->maxn; components++) {
+				if (components == 1 && z_lookup != 0) {
+					continue;
+				}
+
+				struct level lv;
+				if (!level_open(ds, components, z_lookup, &lv)) {
+					continue;
+				}
+
+				long long r;
+				for (r = 0; r < lv.records; r++) {
+					unsigned int x[components], y[components];
+					unsigned long long meta = 0;
+
+					if (lv.split) {
+						buf2xys(level_record(&lv, r), ds->mapbits, 0, z_lookup, components, x, y, &meta);
+						if (wantmeta) {
+							meta = level_meta(&lv, r);
+						}
+					} else {
+						buf2xys(level_record(&lv, r), ds->mapbits, ds->metabits, z_lookup, components, x, y, &meta);
+					}
+
+					// Every new point moves the ones after it
+					// in the merged level, filtered out or not
+					if (components == 1 && zs >= minzoom) {
+						addpoint(&added, zs, x[0], y[0]);
+					}
+
+					// Records that the metadata filter leaves out aren't drawn
+					if (meta > maxmeta || meta < minmeta) {
+						continue;
+					}
+
+					add_record(zooms, minzoom, maxzoom, ds->mapbits, components, z_lookup, x, y, meta);
+				}
+
+				level_close(&lv);
+			}
+		}
+
+		dataset_close(ds);
+	}
+
+	if (zs >= minzoom) {
+		shifted(zooms, minzoom, zs, merged, &added);
+	}
+	free(added.keys);
+	dataset_close(merged);
+
+	// With metatiles, each block is listed once, by its top left tile,
+	// which is enough for render -k to draw all of it
+
+	int z;
+	for (z = minzoom; z <= maxzoom; z++) {
+		struct zoom *zm = &zooms[z];
+		long long t;
+
+		int m = metatile;
+		while (m > 1 && m > (1LL << z)) {
+			m /= 2;
+		}
+
+		for (t = 0; t < zm->nkeys; t++) {
+			unsigned int x, y;
+			key2zxy(zm->keys[t], z, &x, &y);
+			zm->keys[t] = zxy2key(z, x / m * m, y / m * m);
+		}
+
+		squeeze(zm);
+
+		for (t = 0; t < zm->nkeys; t++) {
+			unsigned int x, y;
+			key2zxy(zm->keys[t], z, &x, &y);
+			printf("%s %d %u %u\n", name, z, x, y);
+		}
+
+		free(zm->keys);
+	}
+
+	return 0;
+}
@@ -0,0 +1,860 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include "util.h"
+#include "graphics.h"
+#include "clip.h"
+#include "dump.h"
+#include "dataset.h"
+#include "summary.h"
+#include "draw.h"
+
+int dot_base = 13;
+double dot_bright = 0.05917;
+double dot_ramp = 1.23;
+
+double point_size = 1;
+int gaussian = 0;
+
+double line_per_dot = 6.64;
+double line_ramp = 1;
+double line_thick = 1;
+
+int gps_base = 16;
+double gps_dist = 1600; // about 50 feet
+double gps_ramp = 1.5;
+
+double display_gamma = .5;
+double color_cap = .7;
+int cie = 0;
+
+int antialias = 1;
+double mercator = -1;
+double exponent = 2;
+int metabright = 0;
+int metabrush = 0;
+long long minmeta = 0;
+long long maxmeta = LLONG_MAX;
+
+int tilesize = 256;
+
+float circle = -1;
+int circle_random = 0;
+
+// How the drawing is turned into colors, see out()
+int transparency = 255;
+int invert = 0;
+int bg = 0; // bg is #000000 by default
+int color = -1;
+int color2 = -1;
+int saturate = 1;
+int mask = 0;
+
+int gps = 0;
+struct color_range colors;
+
+static double cloudsize(int z_draw, int x_draw, int y_draw, int metatile) {
+	double lat, lon;
+	tile2latlon((x_draw + metatile / 2.0) * (1LL << (32 - z_draw)),
+		    (y_draw + metatile / 2.0) * (1LL << (32 - z_draw)),
+		    32, &lat, &lon);
+	double rat = cos(lat * M_PI / 180);
+
+	double size = circle * .00000274;  // in degrees
+	size /= rat;                       // adjust for latitude
+	size /= 360.0 / (1 << z_draw);     // convert to tiles
+
+	return size;
+}
+
+// Below dot_base, only every step-th point is drawn, counting from the
+// start of the level, so that each zoom draws a superset of the last
+int draw_step(int z_draw) {
+	if (z_draw >= dot_base) {
+		return 1;
+	}
+
+	return floor(exp(log(exponent) * (dot_base - z_draw)) + .5);
+}
+
+// How many pixels beyond its own position a record drawn at z_draw
+// can paint, the way process() draws it, so that other programs can tell
+// which tiles it touches. Points that only ever cover a single pixel
+// don't reach into other tiles, since those tiles don't look for them.
+double draw_reach(int components, int z_draw, double lat, unsigned long long meta) {
+	if (components > 1) {
+		double thick = line_thick;
+		if (line_ramp >= 1) {
+			thick *= exp(log(line_ramp) * (z_draw - dot_base));
+		}
+
+		// Half the width, and a pixel either side for antialiasing
+		return thick * tilesize / 256.0 / 2 + 1;
+	}
+
+	double brush = 1;
+	if (z_draw > dot_base) {
+		brush = exp(log(2.0) * (z_draw - dot_base));
+	}
+	brush *= point_size;
+
+	if (mercator >= 0) {
+		double rat = cos(lat * M_PI / 180);
+		double base = cos(mercator * M_PI / 180);
+		brush /= rat * rat / (base * base);
+	}
+
+	double bb = brush * (tilesize / 256.0) * (tilesize / 256.0);
+	if (metabrush) {
+		bb *= meta;
+	}
+
+	if (circle > 0) {
+		double size = circle * .00000274 / cos(lat * M_PI / 180) / (360.0 / (1 << z_draw)) * tilesize;
+		return sqrt(bb / M_PI) + 2 + size;
+	}
+
+	if (bb <= 1) {
+		return 0;
+	}
+
+	return sqrt(bb / M_PI) + 2;
+}
+
+int process(struct dataset *ds, int components, int z_lookup, const struct range *ranges, int nranges, int z_range, int z_draw, int x_draw, int y_draw, struct graphics *gc, int mapbits, int metabits, int dump, int gps, struct color_range *colors, int xoff, int yoff, int nearby, int metatile) {
+	int ret = 0;
+
+	struct tilecontext tc;
+	tc.z = z_draw;
+	tc.x = x_draw;
+	tc.y = y_draw;
+	tc.xoff = xoff;
+	tc.yoff = yoff;
+
+	struct level lv;
+	if (!level_open(ds, components, z_lookup, &lv) || lv.records < 1) {
+		level_close(&lv);
+		return ret;
+	}
+
+	int bytes = lv.bytes;
+
+	// If the metadata is in a column of its own, only read it
+	// if something is actually going to be done with it
+	int wantmeta = metabits > 0 && (dump || colors->active || metabright || metabrush || circle > 0 ||
+					minmeta > 0 || maxmeta < LLONG_MAX || graphics_wants_meta(gc));
+
+	int step = 1;
+	double brush = 1;
+	double thick = line_thick;
+	double bright1;
+	if (components == 1) {
+		bright1 = dot_bright;
+
+		if (z_draw > dot_base) {
+			step = 1;
+			brush = exp(log(2.0) * (z_draw - dot_base));
+			bright1 *= exp(log(dot_ramp) * (z_draw - dot_base));
+		} else {
+			step = draw_step(z_draw);
+			bright1 *= exp(log(dot_ramp) * (z_draw - dot_base));
+			bright1 = bright1 * step / (1 << (dot_base - z_draw));
+		}
+
+		bright1 /= point_size;
+		brush *= point_size;
+	} else {
+		bright1 = dot_bright * line_per_dot / line_thick;
+
+		if (line_ramp >= 1) {
+			thick *= exp(log(line_ramp) * (z_draw - dot_base));
+			bright1 *= exp(log(dot_ramp / line_ramp) * (z_draw - dot_base));
+		} else {
+			bright1 *= exp(log(dot_ramp) * (z_draw - dot_base));
+		}
+	}
+
+	if (mercator >= 0) {
+		double lat, lon;
+		tile2latlon((x_draw + metatile / 2.0) * (1LL << (32 - z_draw)),
+			    (y_draw + metatile / 2.0) * (1LL << (32 - z_draw)),
+			    32, &lat, &lon);
+		double rat = cos(lat * M_PI / 180);
+
+		double base = cos(mercator * M_PI / 180);
+		brush /= rat * rat / (base * base);
+	}
+
+	if (dump) {
+		step = 1;
+	}
+
+	double size = cloudsize(z_draw, x_draw, y_draw, metatile);
+	int innerstep = 1;
+	long long todo = 0;
+
+	size *= tilesize;                  // convert to pixels
+
+	if (circle > 0) {
+		// An additional 4 zoom levels without skipping
+		// XXX Why 4?
+		if (step > 1 && size > .0625) {
+			innerstep = step;
+			step = 1;
+		}
+	}
+
+	const double b = brush * (tilesize / 256.0) * (tilesize / 256.0);
+
+	// Whole blocks can be skipped when filtering by metadata
+	struct summary *sum = NULL;
+	if (minmeta > 0 || maxmeta < LLONG_MAX) {
+		char fn[11 + 1 + 11 + 1];
+		sprintf(fn, "%d,%d", components, components == 1 ? 0 : z_lookup);
+		sum = summary_open(ds, fn, lv.records);
+	}
+
+	// The tile of the last record, at the zoom of the ranges
+	long long tilex = -1, tiley = -1;
+
+	long long page = sysconf(_SC_PAGESIZE);
+	unsigned char startbuf[bytes];
+	unsigned char endbuf[bytes];
+	int r;
+
+	for (r = 0; r < nranges; r++) {
+		range2bufs(z_range, &ranges[r], startbuf, endbuf, bytes);
+
+		long long start = level_search(&lv, startbuf);
+		long long end = level_search(&lv, endbuf);
+
+		// points to the last value in range; need the one after that,
+		// unless the range is all before the first record
+		if (memcmp(level_record(&lv, end), endbuf, bytes) <= 0) {
+			end++;
+		}
+
+		if (memcmp(level_record(&lv, start), startbuf, bytes) < 0) {
+			start++; // if not exact match, points to element before match
+		}
+
+		if (!dump) {
+			// Align to step size so each zoom is a superset of the previous
+			start = (start + step - 1) / step * step;
+		}
+
+		// Get the kernel reading the whole range in at once instead of
+		// faulting it in a page at a time, unless the steps are so far
+		// apart that most of the pages wouldn't be used
+		if ((end - start) * bytes > 2 * page && step * bytes < page) {
+			level_advise(&lv, start, end - 1, POSIX_MADV_WILLNEED, wantmeta);
+		}
+
+		long long blockend = start;
+
+		for (; start < end; start += step) {
+			if (sum != NULL && start >= blockend) {
+				long long block = start / sum->records;
+				blockend = (block + 1) * sum->records;
+
+				if (!summary_overlaps(sum, block, minmeta, maxmeta)) {
+					// Go on to the first record of the next block
+					// that lines up with the step size
+					long long next = ((block + 1) * sum->records + step - 1) / step * step;
+					start = next - step;
+					continue;
+				}
+			}
+
+			unsigned int x[components], y[components];
+			double xd[components], yd[components];
+			int k;
+			unsigned long long meta = 0;
+
+			if (lv.split) {
+				buf2xys(level_record(&lv, start), mapbits, 0, z_lookup, components, x, y, &meta);
+				if (wantmeta) {
+					meta = level_meta(&lv, start);
+				}
+			} else {
+				buf2xys(level_record(&lv, start), mapbits, metabits, z_lookup, components, x, y, &meta);
+			}
+
+			// The clouds of each tile count out their random points
+			// from zero, so that they come out the same however
+			// the tiles are grouped into ranges
+			if (circle_random && ((long long) ((unsigned long long) x[0] >> (32 - z_range)) != tilex ||
+					      (long long) ((unsigned long long) y[0] >> (32 - z_range)) != tiley)) {
+				tilex = (unsigned long long) x[0] >> (32 - z_range);
+				tiley = (unsigned long long) y[0] >> (32 - z_range);
+				todo = 0;
+			}
+
+			if (meta > maxmeta || meta < minmeta) {
+				continue;
+			}
+
+			if (!dump && z_draw >= mapbits / 2 - 8) {
+				// Add noise below the bottom of the file resolution
+				// so that it looks less gridded when overzoomed
+
+				int j;
+				for (j = 0; j < components; j++) {
+					int noisebits = 32 - mapbits / 2;
+					int i;
+
+					for (i = 0; i < noisebits; i++) {
+						x[j] |= ((y[j] >> (2 * noisebits - 1 - i)) & 1) << i;
+						y[j] |= ((x[j] >> (2 * noisebits - 1 - i)) & 1) << i;
+					}
+				}
+			}
+
+			double hue = -1;
+			if (metabits > 0 && colors->active) {
+				hue = (((double) meta - colors->meta1) / (colors->meta2 - colors->meta1) * (colors->hue2 - colors->hue1) + colors->hue1) / 360;
+
+				if (hue < -2) {
+					hue = -1;
+				} else {
+					while (hue < 0) {
+						hue++;
+					}
+					while (hue > 1) {
+						hue--;
+					}
+				}
+			}
+
+			double bright = bright1;
+			double bb = b;
+
+			if (metabright) {
+				bright *= meta;
+			}
+			if (metabrush) {
+				bb = bb * meta;
+			}
+
+			for (k = 0; k < components; k++) {
+				wxy2fxy(x[k], y[k], &xd[k], &yd[k], z_draw, x_draw, y_draw);
+			}
+
+			if (nearby && components == 1 && !circle_random) {
+				// Points from around the tile only matter
+				// if their brush or cloud reaches into it.
+				// (Random clouds carry their point count from
+				// one point to the next, so they can't skip.)
+
+				double reach = sqrt(bb / M_PI) + 2;
+				if (circle > 0) {
+					reach += size;
+				}
+				reach /= tilesize;
+
+				if (xd[0] < -reach || yd[0] < -reach || xd[0] > metatile + reach || yd[0] > metatile + reach) {
+					continue;
+				}
+			}
+
+			if (dump) {
+				int should = 0;
+
+				if (components == 1) {
+					should = 1;
+				} else {
+					for (k = 1; k < components; k++) {
+						double x1 = xd[k - 1];
+						double y1 = yd[k - 1];
+						double x2 = xd[k];
+						double y2 = yd[k];
+
+						if (clip(&x1, &y1, &x2, &y2, 0, 0, 1, 1)) {
+							should = 1;
+							break;
+						}
+					}
+				}
+
+				if (should) {
+					dump_out(dump, x, y, components, metabits, meta);
+				}
+			} else if (components == 1) {
+				if (!antialias) {
+					xd[0] = ((int) (xd[0] * tilesize) + .5) / tilesize;
+					yd[0] = ((int) (yd[0] * tilesize) + .5) / tilesize;
+				}
+
+				if (circle > 0) {
+					if (size < .5) {
+						if (bb <= 1) {
+							drawPixel((xd[0] * tilesize - .5) + xoff, (yd[0] * tilesize - .5) + yoff, gc, bright * bb * meta / innerstep, hue, meta, &tc);
+						} else {
+							drawBrush((xd[0] * tilesize) + xoff, (yd[0] * tilesize) + yoff, gc, bright * meta / innerstep, bb, hue, meta, gaussian, &tc);
+							ret = 1;
+						}
+					} else {
+						double xc = (xd[0] * tilesize) + xoff;
+						double yc = (yd[0] * tilesize) + yoff;
+
+						if (!circle_random) {
+							// The average of all the random points:
+							// an even disk with the same total brightness.
+
+							double n = (double) meta / innerstep;
+							drawDisk(xc, yc, gc, bright * bb * n / (M_PI * size * size), size, hue, meta, &tc);
+						} else if (xc + size >= 0 &&
+						    yc + size >= 0 &&
+						    xc - size <= tilesize &&
+						    yc - size <= tilesize) {
+							unsigned int seed = x[0] * 37 + y[0];
+
+							for (todo += meta; todo > 0; todo -= innerstep) {
+								double r = sqrt(((double) (rand_r(&seed) & (INT_MAX - 1))) / (INT_MAX));
+								double ang = ((double) (rand_r(&seed) & (INT_MAX - 1))) / (INT_MAX) * 2 * M_PI;
+
+								double xp = xc + size * r * cos(ang);
+								double yp = yc + size * r * sin(ang);
+
+								if (bb <= 1) {
+									drawPixel(xp - .5, yp - .5, gc, bright * bb, hue, meta, &tc);
+								} else {
+									drawBrush(xp, yp, gc, bright, bb, hue, meta, gaussian, &tc);
+									ret = 1;
+								}
+							}
+						}
+					}
+				} else {
+					if (bb <= 1) {
+						drawPixel((xd[0] * tilesize - .5) + xoff, (yd[0] * tilesize - .5) + yoff, gc, bright * bb, hue, meta, &tc);
+					} else {
+						drawBrush((xd[0] * tilesize) + xoff, (yd[0] * tilesize) + yoff, gc, bright, bb, hue, meta, gaussian, &tc);
+						ret = 1;
+					}
+				}
+			} else {
+				for (k = 1; k < components; k++) {
+					double bright1 = bright;
+
+					long long xk1 = x[k - 1];
+					long long xk = x[k];
+
+					if (gps) {
+						double xdist = (long long) x[k] - (long long) x[k - 1];
+						double ydist = (long long) y[k] - (long long) y[k - 1];
+						double dist = sqrt(xdist * xdist + ydist * ydist);
+
+						double min = gps_dist;
+						min = min * exp(log(gps_ramp) * (gps_base - z_draw));
+
+						if (dist > min) {
+							bright1 /= (dist / min);
+						}
+
+						if (bright1 < .0025) {
+							continue;
+						}
+					}
+
+					double thick1 = thick * tilesize / 256.0;
+
+					if (xk - xk1 >= (1LL << 31)) {
+						wxy2fxy(xk - (1LL << 32), y[k], &xd[k], &yd[k], z_draw, x_draw, y_draw);
+						drawClip(xd[k - 1] * tilesize + xoff, yd[k - 1] * tilesize + yoff, xd[k] * tilesize + xoff, yd[k] * tilesize + yoff, gc, bright1, hue, meta, antialias, thick1, &tc);
+
+						wxy2fxy(x[k], y[k], &xd[k], &yd[k], z_draw, x_draw, y_draw);
+						wxy2fxy(xk1 + (1LL << 32), y[k - 1], &xd[k - 1], &yd[k - 1], z_draw, x_draw, y_draw);
+						drawClip(xd[k - 1] * tilesize + xoff, yd[k - 1] * tilesize + yoff, xd[k] * tilesize + xoff, yd[k] * tilesize + yoff, gc, bright1, hue, meta, antialias, thick1, &tc);
+
+						wxy2fxy(x[k - 1], y[k - 1], &xd[k - 1], &yd[k - 1], z_draw, x_draw, y_draw);
+					} else if (xk1 - xk >= (1LL << 31)) {
+						wxy2fxy(xk1 - (1LL << 32), y[k - 1], &xd[k - 1], &yd[k - 1], z_draw, x_draw, y_draw);
+						drawClip(xd[k - 1] * tilesize + xoff, yd[k - 1] * tilesize + yoff, xd[k] * tilesize + xoff, yd[k] * tilesize + yoff, gc, bright1, hue, meta, antialias, thick1, &tc);
+
+						wxy2fxy(x[k - 1], y[k - 1], &xd[k - 1], &yd[k - 1], z_draw, x_draw, y_draw);
+						wxy2fxy(xk + (1LL << 32), y[k], &xd[k], &yd[k], z_draw, x_draw, y_draw);
+						drawClip(xd[k - 1] * tilesize + xoff, yd[k - 1] * tilesize + yoff, xd[k] * tilesize + xoff, yd[k] * tilesize + yoff, gc, bright1, hue, meta, antialias, thick1, &tc);
+
+						wxy2fxy(x[k], y[k], &xd[k], &yd[k], z_draw, x_draw, y_draw);
+					} else {
+						drawClip(xd[k - 1] * tilesize + xoff, yd[k - 1] * tilesize + yoff, xd[k] * tilesize + xoff, yd[k] * tilesize + yoff, gc, bright1, hue, meta, antialias, thick1, &tc);
+					}
+				}
+			}
+		}
+
+	}
+
+	if (sum != NULL) {
+		summary_close(sum);
+	}
+
+	level_close(&lv);
+	return ret;
+}
+
+void *fmalloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+// Encode a finished tile into memory, as out() would write it
+char *out_buffer(struct graphics *gc, size_t *len) {
+	char *buf = NULL;
+
+	FILE *fp = open_memstream(&buf, len);
+	if (fp == NULL) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+
+	out(gc, fp, transparency, display_gamma, invert, bg, color, color2, saturate, mask, color_cap, cie);
+
+	if (fclose(fp) != 0) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+
+	return buf;
+}
+
+// One dataset's share of drawing a tile
+struct pass {
+	struct graphics *gc;
+	struct file *file;
+	struct color_range *colors;
+	unsigned int z, x, y;
+	int gps;
+	int dump;
+	int pass;
+	int xoff;
+	int yoff;
+	int metatile;
+	int threaded;
+	pthread_t thread;
+};
+
+static void *run_pass(void *v) {
+	struct pass *p = v;
+
+	do_tile(p->gc, p->z, p->x, p->y, p->file->bytes, p->colors, p->file->ds, p->file->mapbits, p->file->metabits, p->gps, p->dump, p->file->maxn, p->pass, p->xoff, p->yoff, 0, p->metatile);
+	return NULL;
+}
+
+// Draw a tile from each of the datasets. Every dataset after the first
+// is read by its own thread into its own plane, and the planes are added
+// together at the end. Dumps, and backends that can't draw into separate
+// planes, go through the datasets one at a time instead.
+void draw_files(struct graphics *gc, struct file *files, int nfiles, struct color_range *colors, unsigned int z, unsigned int x, unsigned int y, int gps, int dump, int xoff, int yoff, int metatile) {
+	struct pass passes[nfiles];
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		passes[i].gc = gc;
+		passes[i].file = &files[i];
+		passes[i].colors = colors;
+		passes[i].z = z;
+		passes[i].x = x;
+		passes[i].y = y;
+		passes[i].gps = gps;
+		passes[i].dump = dump;
+		passes[i].pass = i;
+		passes[i].xoff = xoff;
+		passes[i].yoff = yoff;
+		passes[i].metatile = metatile;
+		passes[i].threaded = 0;
+
+		if (i > 0 && !dump) {
+			struct graphics *plane = graphics_plane(gc);
+
+			if (plane != NULL) {
+				passes[i].gc = plane;
+				passes[i].threaded = 1;
+
+				if (pthread_create(&passes[i].thread, NULL, run_pass, &passes[i]) != 0) {
+					perror("pthread_create");
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		if (!passes[i].threaded) {
+			run_pass(&passes[i]);
+		}
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		if (passes[i].threaded) {
+			if (pthread_join(passes[i].thread, NULL) != 0) {
+				perror("pthread_join");
+				exit(EXIT_FAILURE);
+			}
+
+			graphics_merge(gc, passes[i].gc);
+		}
+	}
+}
+
+void do_tile(struct graphics *gc, unsigned int z_draw, unsigned int x_draw, unsigned int y_draw,
+		int bytes, struct color_range *colors, struct dataset *ds, int mapbits, int metabits, int gps, int dump, int maxn, int pass,
+		int xoff, int yoff, int assemble, int metatile) {
+	int i;
+
+	// The area being drawn is one tile, or a block of metatile x metatile
+	// tiles, which is all of a single tile at zoom z_block.
+
+	int shift = 0;
+	while ((1 << shift) < metatile) {
+		shift++;
+	}
+
+	unsigned int z_block = z_draw - shift;
+	struct range block;
+	block.start = block.end = zxy2key(z_block, x_draw >> shift, y_draw >> shift);
+
+	// Do the single-point case
+
+	int further = process(ds, 1, z_draw, &block, 1, z_block, z_draw, x_draw, y_draw, gc, mapbits, metabits, dump, gps, colors, xoff, yoff, 0, metatile);
+
+	// When overzoomed, also look up the adjacent tiles
+	// to keep from drawing partial circles. They are all
+	// read in one pass, as a few runs of quadkeys.
+
+	if ((further || circle > 0) && !dump && !assemble) {
+		int above = 1;
+		int below = 1;
+
+		if (circle > 0) {
+			double size = cloudsize(z_draw, x_draw, y_draw, metatile);
+			above = size + 1;
+			below = size + 1;
+		}
+
+		int max = (above + below + metatile) * (above + below + metatile) + 1;
+		struct range *ranges = malloc(max * sizeof(struct range));
+		if (ranges == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		int nranges = tiles2ranges(z_draw, (long long) x_draw - above, (long long) y_draw - above,
+					   (long long) x_draw + metatile - 1 + below, (long long) y_draw + metatile - 1 + below, ranges, max - 1);
+		nranges = removerange(ranges, nranges, block.start << (2 * shift), ((block.start + 1) << (2 * shift)) - 1);
+
+		process(ds, 1, z_draw, ranges, nranges, z_draw, z_draw, x_draw, y_draw, gc, mapbits, metabits, dump, gps, colors, xoff, yoff, 1, metatile);
+		free(ranges);
+	}
+
+	// Do the zoom levels numbered greater than this one.
+	//
+	// For zoom levels greater than this one, we look up the entire area
+	// of the tile we are drawing, which will end up being multiple tiles
+	// of the higher zoom.
+
+	int z_lookup;
+	for (z_lookup = z_draw + 1; (dump || z_lookup < z_draw + 9) && z_lookup <= mapbits / 2; z_lookup++) {
+		for (i = 2; i <= maxn; i++) {
+			process(ds, i, z_lookup, &block, 1, z_block, z_draw, x_draw, y_draw, gc, mapbits, metabits, dump, gps, colors, xoff, yoff, 0, metatile);
+		}
+	}
+
+	// For zoom levels numbered less than this one, each stage looks up a
+	// larger area for potential overlaps. Within a metatile, the levels
+	// down to z_block still only need the area of the block.
+
+	for (z_lookup = z_draw; z_lookup >= 0; z_lookup--) {
+		unsigned int z_range = z_lookup < z_block ? z_lookup : z_block;
+
+		struct range up;
+		up.start = up.end = zxy2key(z_range, x_draw >> (z_draw - z_range), y_draw >> (z_draw - z_range));
+
+		for (i = 2; i <= maxn; i++) {
+			process(ds, i, z_lookup, &up, 1, z_range, z_draw, x_draw, y_draw, gc, mapbits, metabits, dump, gps, colors, xoff, yoff, 0, metatile);
+		}
+	}
+}
+
+// Options that change how tiles are drawn, for every program that
+// draws them. Returns 1 if the option was one of them, 0 if it wasn't,
+// and -1 if its argument couldn't be understood.
+int draw_option(int opt, char *optarg) {
+	switch (opt) {
+		case 't':
+			transparency = atoi(optarg);
+			return 1;
+
+		case 'm':
+			mask = 1;
+			return 1;
+
+		case 's':
+			saturate = 0;
+			return 1;
+
+		case 'g':
+			gps = 1;
+			return 1;
+
+		case 'C':
+			if (sscanf(optarg, "%lld:%lf:%lld:%lf",
+				&colors.meta1, &colors.hue1,
+				&colors.meta2, &colors.hue2) == 4) {
+				colors.active = 1;
+			} else if (sscanf(optarg, "%lld", &colors.meta2) == 1) {
+				colors.meta1 = 0;
+				colors.hue1 = 0;
+				colors.hue2 = 360;
+				colors.active = 1;
+			} else {
+				fprintf(stderr, "Can't understand -%c %s\n", opt, optarg);
+				return -1;
+			}
+
+			return 1;
+
+		case 'c':
+			color = strtoul(optarg, NULL, 16);
+			return 1;
+
+		case 'S':
+			color2 = strtoul(optarg, NULL, 16);
+			return 1;
+
+		case 'B':
+			if (sscanf(optarg, "%d:%lf:%lf", &dot_base, &dot_bright, &dot_ramp) != 3) {
+				fprintf(stderr, "Can't understand -B %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'O':
+			if (sscanf(optarg, "%d:%lf:%lf", &gps_base, &gps_dist, &gps_ramp) != 3) {
+				fprintf(stderr, "Can't understand -O %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'G':
+			if (sscanf(optarg, "%lf", &display_gamma) != 1) {
+				fprintf(stderr, "Can't understand -G %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'l':
+			if (sscanf(optarg, "%lf", &line_ramp) != 1) {
+				fprintf(stderr, "Can't understand -l %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'L':
+			if (sscanf(optarg, "%lf", &line_thick) != 1) {
+				fprintf(stderr, "Can't understand -L %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'a':
+			antialias = 0;
+			return 1;
+
+		case 'M':
+			if (sscanf(optarg, "%lf", &mercator) != 1) {
+				fprintf(stderr, "Can't understand -M %s\n", optarg);
+				return -1;
+			}
+			return 1;
+
+		case 'w':
+			bg = strtoul("FFFFFF", NULL, 16);
+			invert = 1;
+			return 1;
+
+		case 'b':
+			bg = strtoul(optarg, NULL, 16);
+			return 1;
+
+		case 'T':
+			tilesize = atoi(optarg);
+			return 1;
+
+		case 'x':
+			{
+				char unit;
+				long long lo, hi;
+
+				if (strcmp(optarg, "b") == 0) {
+					metabright = 1;
+				} else if (strcmp(optarg, "r") == 0) {
+					metabrush = 1;
+				} else if (strcmp(optarg, "u") == 0) {
+					cie = 1;
+				} else if (sscanf(optarg, "l%lld:%lld", &lo, &hi) == 2) {
+					minmeta = lo < 0 ? 0 : lo;
+					maxmeta = hi;
+				} else if (sscanf(optarg, "l%lld", &hi) == 1) {
+					minmeta = 0;
+					maxmeta = hi;
+				} else if (sscanf(optarg, "c%f%c", &circle, &unit) == 2 ||
+					   sscanf(optarg, "C%f%c", &circle, &unit) == 2) {
+					if (*optarg == 'C') {
+						circle_random = 1;
+					}
+
+					if (unit == 'm') {
+						circle *= 3.28; // meters to feet
+					} else if (unit == 'f') {
+						;
+					} else {
+						fprintf(stderr, "Can't understand unit in -x %s\n", optarg);
+						return -1;
+					}
+				} else if (sscanf(optarg, "s%lf", &color_cap) == 1) {
+					;
+				} else {
+					fprintf(stderr, "Can't understand -x %s\n", optarg);
+					return -1;
+				}
+			}
+			return 1;
+
+		case 'e':
+			if (sscanf(optarg, "%lf", &exponent) != 1) {
+				fprintf(stderr, "Can't understand -%c %s\n", opt, optarg);
+				return -1;
+			}
+			if (exponent < 1) {
+				fprintf(stderr, "Exponent can't be less than 1: %f\n", exponent);
+				return -1;
+			}
+			return 1;
+
+		case 'p':
+			if (sscanf(optarg, "g%lf", &point_size) == 1) {
+				gaussian = 1;
+			} else if (sscanf(optarg, "%lf", &point_size) != 1) {
+				fprintf(stderr, "Can't understand -%c %s\n", opt, optarg);
+				return -1;
+			}
+			return 1;
+	}
+
+	return 0;
+}
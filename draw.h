@@ -0,0 +1,76 @@
+// Drawing the tiles of datasets, shared by render and tilegen.
+// The options that control it are globals, set by draw_option().
+
+extern int dot_base;
+extern double dot_bright;
+extern double dot_ramp;
+
+extern double point_size;
+extern int gaussian;
+
+extern double line_per_dot;
+extern double line_ramp;
+extern double line_thick;
+
+extern int gps_base;
+extern double gps_dist;
+extern double gps_ramp;
+
+extern double display_gamma;
+extern double color_cap;
+extern int cie;
+
+extern int antialias;
+extern double mercator;
+extern double exponent;
+extern int metabright;
+extern int metabrush;
+extern long long minmeta;
+extern long long maxmeta;
+
+extern int tilesize;
+
+extern float circle;
+extern int circle_random;
+
+extern int transparency;
+extern int invert;
+extern int bg;
+extern int color;
+extern int color2;
+extern int saturate;
+extern int mask;
+
+struct color_range {
+	long long meta1;
+	double hue1;
+
+	long long meta2;
+	double hue2;
+
+	int active;
+};
+
+struct file {
+	char *name;
+	struct dataset *ds;
+	int mapbits;
+	int metabits;
+	int maxn;
+	int bytes;
+};
+
+
+extern int gps;
+extern struct color_range colors;
+
+int draw_option(int opt, char *optarg);
+int draw_step(int z_draw);
+double draw_reach(int components, int z_draw, double lat, unsigned long long meta);
+
+// metatile is how many tiles across and down are drawn together
+void do_tile(struct graphics *gc, unsigned int z_draw, unsigned int x_draw, unsigned int y_draw, int bytes, struct color_range *colors, struct dataset *ds, int mapbits, int metabits, int gps, int dump, int maxn, int pass, int xoff, int yoff, int assemble, int metatile);
+void draw_files(struct graphics *gc, struct file *files, int nfiles, struct color_range *colors, unsigned int z, unsigned int x, unsigned int y, int gps, int dump, int xoff, int yoff, int metatile);
+
+void *fmalloc(size_t size);
+char *out_buffer(struct graphics *gc, size_t *len);
@@ -9,6 +9,9 @@
 #include <string.h>
 #include <fcntl.h>
 #include "util.h"
+#include "dataset.h"
+#include "summary.h"
+#include "occupancy.h"
 
 int mapbits = 2 * (16 + 8); // zoom level 16
 int metabits = 0;
@@ -24,7 +27,7 @@ struct file {
 };
 
 void usage(char *name) {
-	fprintf(stderr, "Usage: %s [-z zoom] [-m metadata-bits] -o destdir [file ...]\n",
+	fprintf(stderr, "Usage: %s [-z zoom] [-m metadata-bits] [-cs] [-i zoom] -o destdir [file ...]\n",
 		name);
 }
 
@@ -238,8 +241,11 @@ int main(int argc, char **argv) {
 	extern int optind;
 	extern char *optarg;
 	char *destdir = NULL;
+	int compress = 0;
+	int split = 0;
+	int occzoom = -1;
 
-	while ((i = getopt(argc, argv, "z:m:o:")) != -1) {
+	while ((i = getopt(argc, argv, "z:m:o:csi:")) != -1) {
 		switch (i) {
 		case 'z':
 			mapbits = 2 * (atoi(optarg) + 8);
@@ -253,6 +259,18 @@ int main(int argc, char **argv) {
 			destdir = optarg;
 			break;
 
+		case 'c':
+			compress = 1;
+			break;
+
+		case 's':
+			split = 1;
+			break;
+
+		case 'i':
+			occzoom = atoi(optarg);
+			break;
+
 		default:
 			usage(argv[0]);
 			exit(EXIT_FAILURE);
@@ -294,16 +312,13 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	char s[strlen(destdir) + 5 + 1];
-	sprintf(s, "%s/meta", destdir);
-	FILE *f = fopen(s, "w");
-	if (f == NULL) {
-		perror(s);
-		exit(EXIT_FAILURE);
+	// Without any metadata there is nothing to split off
+	if (metabits == 0) {
+		split = 0;
 	}
-	fprintf(f, "1\n");
-	fprintf(f, "%d %d %d\n", mapbits, metabits, maxn);
-	fclose(f);
+
+	int flags = (compress ? DATASET_COMPRESSED : 0) | (split ? DATASET_SPLIT : 0);
+	dataset_write_meta(destdir, mapbits, metabits, maxn, flags);
 
 	for (; files != NULL; files = files->next) {
 		fclose(files->f);
@@ -400,7 +415,16 @@ int main(int argc, char **argv) {
 		munmap(map, st.st_size);
 		fclose(f);
 		close(fd);
+
+		level_finish(fn, mapbits, metabits, files->legs, files->level, flags);
+	}
+
+	// The tiles with data in them, by default down to the zoom that
+	// the dataset is encoded for
+	if (occzoom < 0) {
+		occzoom = mapbits / 2 - 8;
 	}
+	occupancy_write(destdir, occzoom);
 
 	fprintf(stderr, "\n");
 
@@ -7,23 +7,27 @@
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <pthread.h>
 #include "util.h"
 #include "graphics.h"
 #include "dump.h"
+#include "dataset.h"
+#include "occupancy.h"
 
 struct file {
-	FILE *f;
+	struct level level;
+	long long cursor;
+	long long end;
 	int components;
 	int zoom;
 	int bytes;
-	unsigned char *buf;
-	int done;
+	const unsigned char *buf;
 
 	struct file *next;
 };
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-ad] [-z max] [-Z min] [-b minlat,minlon,maxlat,maxlon] file\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-acd] [-z max] [-Z min] [-b minlat,minlon,maxlat,maxlon] [-k metatile] [-P threads] file\n", argv[0]);
 	exit(EXIT_FAILURE);
 }
 
@@ -42,6 +46,8 @@ struct tile {
 	long long xsum;
 	long long ysum;
 	int sibling[2][2];
+	int metax;
+	int metay;
 };
 
 struct bounds {
@@ -51,13 +57,52 @@ struct bounds {
 	unsigned int bottom;
 };
 
-void handle(long long xx, long long yy, struct tile *tile, char *fname, int minzoom, int maxzoom, int showdist, unsigned int *x, unsigned int *y, struct file **files, int sibling, int verbose, struct bounds *bounds) {
+// What a stretch of consecutive records adds to the tiles. Without -d,
+// that is all the records whose first points are in the same tile at
+// the deepest zoom. With -d it is a single record, so that the lengths
+// add up in the same order no matter how the work was divided.
+struct run {
+	unsigned int x;	// first point of the first record
+	unsigned int y;
+	long long count;	// how many of the records are within the bounds
+	long long xsum;
+	long long ysum;
+	double dist;	// length of the record, in units of zoom 32 tiles
+};
+
+// Add a run to the tiles it is in, first listing any tiles that it
+// has moved past. A NULL run lists whatever is left at the end.
+void handle(struct run *r, struct tile *tile, char *fname, int minzoom, int maxzoom, int showdist, int sibling, int verbose, int metatile) {
+	long long xx = -1, yy = -1;
 	int z;
 
+	if (r != NULL) {
+		xx = r->x;
+		yy = r->y;
+	}
+
 	for (z = minzoom; z <= maxzoom; z++) {
 		if (tile[z].xtile != xx >> (32 - z) ||
 		    tile[z].ytile != yy >> (32 - z)) {
-			if (tile[z].count > 0) {
+			if (tile[z].count > 0 && metatile > 1) {
+				// The tiles of a metatile are all together in quadkey
+				// order, so each block only needs to be listed once.
+
+				int n = metatile;
+				while (n > 1 && n > (1LL << z)) {
+					n /= 2;
+				}
+
+				int mx = tile[z].xtile / n * n;
+				int my = tile[z].ytile / n * n;
+
+				if (mx != tile[z].metax || my != tile[z].metay) {
+					printf("%s %d %d %d\n", fname, z, mx, my);
+
+					tile[z].metax = mx;
+					tile[z].metay = my;
+				}
+			} else if (tile[z].count > 0) {
 				printf("%s %d %d %d",
 					fname,
 					z,
@@ -124,50 +169,472 @@ void handle(long long xx, long long yy, struct tile *tile, char *fname, int minz
 			tile[z].xsum = tile[z].ysum = 0;
 		}
 
-		int include = 0;
-		if (bounds == NULL) {
-			include = 1;
-		} else {
-			if (xx >= bounds->left && xx <= bounds->right &&
-			    yy >= bounds->top && yy <= bounds->bottom) {
-				include = 1;
+		if (r != NULL && r->count > 0) {
+			tile[z].count += r->count;
+			tile[z].xsum += r->xsum;
+			tile[z].ysum += r->ysum;
+
+			if (showdist) {
+				// Scaling by a power of 2 is exact, so this is
+				// the same as adding up the scaled segments
+				tile[z].len += r->dist / (1LL << (32 - z));
 			}
 		}
+	}
+}
+
+// Advance to the next record of the file, if there is one
+int nextrecord(struct file *f) {
+	if (f->cursor >= f->end) {
+		return 0;
+	}
+
+	f->buf = level_full_record(&f->level, f->cursor);
+	f->cursor++;
+	return 1;
+}
+
+void insert(struct file *m, struct file **head, int bytes) {
+	while (*head != NULL && memcmp(m->buf, (*head)->buf, bytes) > 0) {
+		head = &((*head)->next);
+	}
+
+	m->next = *head;
+	*head = m;
+}
+
+// Listing tiles divides the range of first points among threads. Each
+// part is a range of the first 64 bits of the records, which start
+// with the first point, and every level file is cut at the same places
+// by binary search. The parts are listed in order as they finish.
+
+struct part {
+	unsigned long long start;	// first points from here
+	unsigned long long end;	// up to but not including here
+	int last;	// or through the end, for the last one
+
+	struct run *runs;
+	long long nruns;
+	long long nalloc;
+
+	// With -c, the tiles at the deepest zoom that the records cross
+	unsigned long long *cells;
+	long long ncells;
+	long long ncalloc;
+
+	long long read;	// bytes of records, for progress
+	int done;
+};
+
+struct work {
+	struct dataset *ds;
+	int nlevels;
+	int *components;
+	int *zooms;
+
+	struct part *parts;
+	int nparts;
+	int next;	// the next part for a thread to take
+	int listed;	// how many parts have been listed
+	int window;	// how far ahead of the listing threads can get
+
+	int mapbits;
+	int maxzoom;
+	int showdist;
+	int cover;
+	struct bounds *bounds;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// The first 64 bits of a record, which start with its first point
+static unsigned long long prefix(const unsigned char *rec, int bytes) {
+	unsigned long long key = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		key = (key << 8) | (i < bytes ? rec[i] : 0);
+	}
+
+	return key;
+}
+
+// Every other bit of v, from the lowest up
+static unsigned int compact(unsigned long long v) {
+	v &= 0x5555555555555555ULL;
+	v = (v | (v >> 1)) & 0x3333333333333333ULL;
+	v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v >> 4)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v >> 16)) & 0x00000000FFFFFFFFULL;
+	return v;
+}
+
+// The bits of v spread out to every other bit, from the lowest up
+static unsigned long long spread(unsigned int v) {
+	unsigned long long w = v;
+	w = (w | (w << 16)) & 0x0000FFFF0000FFFFULL;
+	w = (w | (w << 8)) & 0x00FF00FF00FF00FFULL;
+	w = (w | (w << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	w = (w | (w << 2)) & 0x3333333333333333ULL;
+	w = (w | (w << 1)) & 0x5555555555555555ULL;
+	return w;
+}
+
+static int keycmp(const void *v1, const void *v2) {
+	const unsigned long long *k1 = v1;
+	const unsigned long long *k2 = v2;
+
+	if (*k1 < *k2) {
+		return -1;
+	} else if (*k1 > *k2) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+// Sort the tiles and drop the duplicates
+static long long uniq(unsigned long long *keys, long long n) {
+	long long i, out = 0;
+
+	qsort(keys, n, sizeof(unsigned long long), keycmp);
+
+	for (i = 0; i < n; i++) {
+		if (out == 0 || keys[out - 1] != keys[i]) {
+			keys[out++] = keys[i];
+		}
+	}
+
+	return out;
+}
+
+static void addcell(struct part *p, int shift, long long x, long long y) {
+	// Off the edge of the world, where half of a segment that
+	// crosses the antimeridian goes
+	if (x < 0 || y < 0 || x >= (1LL << (32 - shift)) || y >= (1LL << (32 - shift))) {
+		return;
+	}
+
+	if (p->ncells >= p->ncalloc) {
+		p->ncalloc = p->ncalloc * 2 + 1024;
+		p->cells = realloc(p->cells, p->ncalloc * sizeof(unsigned long long));
+		if (p->cells == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-		if (include) {
-			tile[z].count++;
-			tile[z].xsum += xx;
-			tile[z].ysum += yy;
+	p->cells[p->ncells++] = spread(x) | (spread(y) << 1);
+}
 
-			if (showdist && x != NULL) {
-				int i;
-				double dist = 0;
-				double max = 1LL << (32 - z);
+struct cover {
+	struct part *p;
+	int shift;
+};
+
+static void cover_tile(void *arg, long long x, long long y) {
+	struct cover *c = arg;
+	addcell(c->p, c->shift, x, y);
+}
+
+static void init_part(struct part *p, unsigned long long start, unsigned long long end, int last) {
+	p->start = start;
+	p->end = end;
+	p->last = last;
+
+	p->runs = NULL;
+	p->nruns = p->nalloc = 0;
+	p->cells = NULL;
+	p->ncells = p->ncalloc = 0;
+	p->read = 0;
+	p->done = 0;
+}
+
+// Divide the first points evenly by the records of the biggest level,
+// at whole points so that every level file is cut in the same places
+static int even_parts(struct part *parts, int want, struct level *biggest, int mapbits) {
+	unsigned long long mask = mapbits >= 64 ? ~0ULL : ~(~0ULL >> mapbits);
+	unsigned long long start = 0;
+	int nparts = 0;
+	int i;
+
+	for (i = 1; i < want && biggest != NULL; i++) {
+		long long n = biggest->records * i / want;
+		if (n >= biggest->records) {
+			break;
+		}
+
+		unsigned long long end = prefix(level_record(biggest, n), biggest->bytes) & mask;
+		if (end > start) {
+			init_part(&parts[nparts++], start, end, 0);
+			start = end;
+		}
+	}
+
+	init_part(&parts[nparts++], start, 0, 1);
+	return nparts;
+}
 
-				for (i = 0; i + 1 < files[0]->components; i++) {
-					double d1 = (long long) x[i] - x[i + 1];
-					double d2 = (long long) y[i] - y[i + 1];
-					double d = sqrt(d1 * d1 + d2 * d2);
+#define MAX_RANGES 4096
+
+// The first points within the bounds, as the quadkey ranges of the
+// tiles that cover them at the deepest zoom that needs no more than
+// MAX_RANGES tiles. Only these ranges of each level need to be read.
+static int bounds_parts(struct part *parts, struct bounds *b, int mapbits) {
+	struct range ranges[MAX_RANGES];
+	int n = bounds2ranges(b->left, b->top, b->right, b->bottom, mapbits / 2, ranges, MAX_RANGES);
+	int i;
+
+	// Nothing is within bounds that are inside out
+	if (n < 0) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (ranges[i].end != ~0ULL) {
+			init_part(&parts[i], ranges[i].start, ranges[i].end + 1, 0);
+		} else {
+			init_part(&parts[i], ranges[i].start, 0, 1);
+		}
+	}
+
+	return n;
+}
+
+struct cursor {
+	struct level *level;
+	int components;
+	int zoom;
+	long long i;
+	long long end;
+	const unsigned char *rec;
+	unsigned long long key;
+};
+
+static int cursorcmp(struct cursor *c1, struct cursor *c2) {
+	if (c1->key != c2->key) {
+		return c1->key < c2->key ? -1 : 1;
+	}
+
+	int bytes = c1->level->bytes < c2->level->bytes ? c1->level->bytes : c2->level->bytes;
+	return memcmp(c1->rec, c2->rec, bytes);
+}
+
+static void sift(struct cursor **heap, int n, int i) {
+	while (1) {
+		int least = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < n && cursorcmp(heap[l], heap[least]) < 0) {
+			least = l;
+		}
+		if (r < n && cursorcmp(heap[r], heap[least]) < 0) {
+			least = r;
+		}
+		if (least == i) {
+			return;
+		}
+
+		struct cursor *c = heap[i];
+		heap[i] = heap[least];
+		heap[least] = c;
+		i = least;
+	}
+}
+
+static void advance(struct cursor *c) {
+	c->rec = level_record(c->level, c->i);
+	c->key = prefix(c->rec, c->level->bytes);
+}
+
+static void addrun(struct part *p, struct run *r) {
+	if (p->nruns >= p->nalloc) {
+		p->nalloc = p->nalloc * 2 + 1024;
+		p->runs = realloc(p->runs, p->nalloc * sizeof(struct run));
+		if (p->runs == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	p->runs[p->nruns++] = *r;
+}
+
+// Only the first component of each vector is indexed, so a record
+// counts toward the tiles of its first point
+static void count_record(struct work *w, struct part *p, struct cursor *c, unsigned long long key) {
+	int shift = 32 - w->maxzoom;
+	int i;
+
+	struct run r;
+	r.x = compact(key);
+	r.y = compact(key >> 1);
+	r.count = 0;
+	r.xsum = r.ysum = 0;
+	r.dist = 0;
+
+	if (w->bounds == NULL ||
+	    (r.x >= w->bounds->left && r.x <= w->bounds->right &&
+	     r.y >= w->bounds->top && r.y <= w->bounds->bottom)) {
+		r.count = 1;
+		r.xsum = r.x;
+		r.ysum = r.y;
+
+		if (w->showdist && c->components > 1) {
+			unsigned int x[c->components], y[c->components];
+			unsigned long long meta;
+			buf2xys(c->rec, w->mapbits, 0, c->zoom, c->components, x, y, &meta);
+
+			for (i = 0; i + 1 < c->components; i++) {
+				double d1 = (long long) x[i] - x[i + 1];
+				double d2 = (long long) y[i] - y[i + 1];
+				double d = sqrt(d1 * d1 + d2 * d2);
 
 #define MAX 6400  /* ~200 feet */
-					if (d < MAX) {
-						dist += sqrt(d1 * d1 + d2 * d2) / max;
-					}
+				if (d < MAX) {
+					r.dist += d;
 				}
-
-				tile[z].len += dist;
 			}
 		}
 	}
+
+	struct run *prev = p->nruns > 0 ? &p->runs[p->nruns - 1] : NULL;
+	if (!w->showdist && prev != NULL &&
+	    (long long) prev->x >> shift == (long long) r.x >> shift &&
+	    (long long) prev->y >> shift == (long long) r.y >> shift) {
+		prev->count += r.count;
+		prev->xsum += r.xsum;
+		prev->ysum += r.ysum;
+	} else {
+		addrun(p, &r);
+	}
 }
 
-void insert(struct file *m, struct file **head, int bytes) {
-	while (*head != NULL && memcmp(m->buf, (*head)->buf, bytes) > 0) {
-		head = &((*head)->next);
+// With -c, a record instead adds every tile at the deepest zoom
+// that any of its segments crosses
+static void cover_record(struct work *w, struct part *p, struct cursor *c) {
+	unsigned int x[c->components], y[c->components];
+	unsigned long long meta;
+	int shift = 32 - w->maxzoom;
+	struct cover cv = {p, shift};
+	int i;
+
+	buf2xys(c->rec, w->mapbits, 0, c->zoom, c->components, x, y, &meta);
+
+	if (c->components == 1) {
+		addcell(p, shift, (long long) x[0] >> shift, (long long) y[0] >> shift);
+	}
+	for (i = 0; i + 1 < c->components; i++) {
+		long long xi = x[i];
+		long long xi1 = x[i + 1];
+
+		// Segments that cross the antimeridian are covered
+		// from both sides, as process() draws them
+		if (xi1 - xi >= (1LL << 31)) {
+			supercover(shift, xi, y[i], xi1 - (1LL << 32), y[i + 1], cover_tile, &cv);
+			supercover(shift, xi + (1LL << 32), y[i], xi1, y[i + 1], cover_tile, &cv);
+		} else if (xi - xi1 >= (1LL << 31)) {
+			supercover(shift, xi - (1LL << 32), y[i], xi1, y[i + 1], cover_tile, &cv);
+			supercover(shift, xi, y[i], xi1 + (1LL << 32), y[i + 1], cover_tile, &cv);
+		} else {
+			supercover(shift, xi, y[i], xi1, y[i + 1], cover_tile, &cv);
+		}
 	}
+}
 
-	m->next = *head;
-	*head = m;
+// Merge the records of every level within the part, in order
+static void list_part(struct work *w, struct level *levels, struct part *p) {
+	struct cursor cursors[w->nlevels];
+	struct cursor *heap[w->nlevels];
+	int n = 0;
+	int i;
+
+	int mapbits = w->mapbits;
+	unsigned long long mask = mapbits >= 64 ? ~0ULL : ~(~0ULL >> mapbits);
+
+	for (i = 0; i < w->nlevels; i++) {
+		struct cursor *c = &cursors[i];
+
+		c->level = &levels[i];
+		c->components = w->components[i];
+		c->zoom = w->zooms[i];
+		c->i = level_find(c->level, p->start);
+		c->end = p->last ? c->level->records : level_find(c->level, p->end);
+
+		if (c->i < c->end) {
+			p->read += (c->end - c->i) * c->level->bytes;
+			advance(c);
+			heap[n++] = c;
+		}
+	}
+
+	for (i = n / 2 - 1; i >= 0; i--) {
+		sift(heap, n, i);
+	}
+
+	while (n > 0) {
+		struct cursor *c = heap[0];
+
+		if (w->cover) {
+			cover_record(w, p, c);
+		} else {
+			count_record(w, p, c, c->key & mask);
+		}
+
+		c->i++;
+		if (c->i < c->end) {
+			advance(c);
+		} else {
+			heap[0] = heap[--n];
+		}
+		sift(heap, n, 0);
+	}
+
+	if (w->cover) {
+		p->ncells = uniq(p->cells, p->ncells);
+	}
+}
+
+static void *run_work(void *v) {
+	struct work *w = v;
+	struct level levels[w->nlevels];
+	int i;
+
+	// Each thread decodes into its own levels
+	for (i = 0; i < w->nlevels; i++) {
+		if (!level_open(w->ds, w->components[i], w->zooms[i], &levels[i])) {
+			fprintf(stderr, "%s/%d,%d: disappeared\n", w->ds->name, w->components[i], w->zooms[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (w->next < w->nparts && w->next >= w->listed + w->window) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->next >= w->nparts) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+		struct part *p = &w->parts[w->next++];
+		pthread_mutex_unlock(&w->lock);
+
+		list_part(w, levels, p);
+
+		pthread_mutex_lock(&w->lock);
+		p->done = 1;
+		pthread_cond_broadcast(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	for (i = 0; i < w->nlevels; i++) {
+		level_close(&levels[i]);
+	}
+
+	return NULL;
 }
 
 int main(int argc, char **argv) {
@@ -182,6 +649,9 @@ int main(int argc, char **argv) {
 	int all = 0;
 	int verbose = 0;
 	int usebounds = 0;
+	int metatile = 1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int cover = 0;
 
 	struct bounds bounds;
 	bounds.top = 0;
@@ -189,7 +659,7 @@ int main(int argc, char **argv) {
 	bounds.bottom = UINT_MAX;
 	bounds.right = UINT_MAX;
 
-	while ((i = getopt(argc, argv, "z:Z:aDdsvb:")) != -1) {
+	while ((i = getopt(argc, argv, "z:Z:aDdsvb:k:P:c")) != -1) {
 		switch (i) {
 		case 'z':
 			maxzoom = atoi(optarg);
@@ -234,6 +704,25 @@ int main(int argc, char **argv) {
 			verbose = 1;
 			break;
 
+		case 'k':
+			metatile = atoi(optarg);
+			if (metatile < 1 || (metatile & (metatile - 1)) != 0) {
+				fprintf(stderr, "Metatile size %s is not a power of 2\n", optarg);
+				usage(argv);
+			}
+			break;
+
+		case 'c':
+			cover = 1;
+			break;
+
+		case 'P':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				usage(argv);
+			}
+			break;
+
 		default:
 			usage(argv);
 		}
@@ -243,35 +732,30 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
-	char *fname = argv[optind];
-
-	char meta[strlen(fname) + 1 + 4 + 1];
-	sprintf(meta, "%s/meta", fname);
-	FILE *f = fopen(meta, "r");
-	if (f == NULL) {
-		perror(meta);
-		exit(EXIT_FAILURE);
+	if (metatile > 1 && (showdist || sibling || verbose)) {
+		fprintf(stderr, "-k can't be used with -d, -s, or -v\n");
+		usage(argv);
 	}
 
-	char s[2000] = "";
-	if (fgets(s, 2000, f) == NULL || strcmp(s, "1\n") != 0) {
-		fprintf(stderr, "%s: Unknown version %s", meta, s);
-		exit(EXIT_FAILURE);
+	if (cover && (showdist || verbose || all)) {
+		fprintf(stderr, "-c can't be used with -a, -d, or -v\n");
+		usage(argv);
 	}
-	int mapbits, metabits, maxn;
-	if (fgets(s, 2000, f) == NULL || sscanf(s, "%d %d %d", &mapbits, &metabits, &maxn) != 3) {
-		fprintf(stderr, "%s: couldn't find size declaration", meta);
-		exit(EXIT_FAILURE);
+
+	if (threads < 1) {
+		threads = 1;
 	}
-	fclose(f);
+
+	char *fname = argv[optind];
+
+	struct dataset *ds = dataset_open(fname);
+	int mapbits = ds->mapbits, metabits = ds->metabits, maxn = ds->maxn;
 
 	if (maxzoom < 0) {
 		maxzoom = mapbits / 2 - 8;
 	}
 
 	int bytes = (mapbits + metabits + 7) / 8;
-	char eof[bytes];
-	memset(eof, 0xFF, bytes);
 	gSortBytes = bytes;
 
 	int depth;
@@ -296,6 +780,44 @@ int main(int argc, char **argv) {
 		tile[i].len = 0;
 		tile[i].xsum = tile[i].ysum = 0;
 		memset(tile[i].sibling, 0, sizeof(tile[i].sibling));
+		tile[i].metax = tile[i].metay = -1;
+	}
+
+	// Without counts, distances, or bounds, all that matters is which
+	// tiles have anything in them, which the occupancy already knows
+	// if it goes deep enough
+
+	if (!all && !showdist && !verbose && !usebounds && !cover) {
+		struct occupancy *occ = occupancy_open(ds);
+
+		if (occ != NULL && occ->zoom >= maxzoom) {
+			long long t;
+
+			for (t = 0; t < occ->tiles; t++) {
+				unsigned int ox, oy;
+				key2zxy(occ->entries[2 * t], occ->zoom, &ox, &oy);
+
+				struct run r;
+				r.x = (unsigned long long) ox << (32 - occ->zoom);
+				r.y = (unsigned long long) oy << (32 - occ->zoom);
+				r.count = 1;
+				r.xsum = r.x;
+				r.ysum = r.y;
+				r.dist = 0;
+
+				handle(&r, tile, fname, minzoom, maxzoom, 0, sibling, 0, metatile);
+			}
+
+			handle(NULL, tile, fname, minzoom, maxzoom, 0, sibling, 0, metatile);
+
+			occupancy_close(occ);
+			dataset_close(ds);
+			return 0;
+		}
+
+		if (occ != NULL) {
+			occupancy_close(occ);
+		}
 	}
 
 	int z_lookup;
@@ -305,96 +827,234 @@ int main(int argc, char **argv) {
 				continue;
 			}
 
-			char fn[strlen(fname) + 1 + 5 + 1 + 5 + 1];
-			sprintf(fn, "%s/%d,%d", fname, i, z_lookup);
-
-			FILE *f = fopen(fn, "r");
-			if (f == NULL) {
-				perror(fn);
+			struct level level;
+			if (!level_open(ds, i, z_lookup, &level)) {
+				fprintf(stderr, "%s/%d,%d: No such file\n", fname, i, z_lookup);
 			} else {
 				files[nfiles] = malloc(sizeof(struct file));
-				files[nfiles]->f = f;
+				files[nfiles]->level = level;
+				files[nfiles]->cursor = 0;
+				files[nfiles]->end = 0;
 				files[nfiles]->components = i;
 				files[nfiles]->zoom = z_lookup;
-				files[nfiles]->bytes = bytesfor(mapbits, metabits, i, z_lookup);
-				files[nfiles]->buf = malloc(files[nfiles]->bytes);
-				files[nfiles]->done = 0;
-
-				struct stat st;
-				if (stat(fn, &st) == 0) {
-					size_total += st.st_size;
-				}
-
-				if (fread(files[nfiles]->buf, files[nfiles]->bytes, 1, files[nfiles]->f) != 1) {
-					memset(files[nfiles]->buf, 0xFF, bytes);
-					files[nfiles]->done = 1;
-				} else {
-					size_read += files[nfiles]->bytes;
-				}
+				files[nfiles]->bytes = level.bytes;
 
+				size_total += level.records * level.bytes;
 				nfiles++;
 			}
 		}
 	}
 
-	if (all) {
-		dump_begin(all);
+	// With bounds, only the ranges of first points within them
+	// need to be read. Lines that cross the bounds from elsewhere
+	// could start anywhere, though, so -c still reads everything.
+
+	struct part *parts = malloc(MAX_RANGES * sizeof(struct part));
+	if (parts == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
 	}
 
-	struct file *head = NULL;
-	for (i = 0; i < nfiles; i++) {
-		if (!files[i]->done) {
-			insert(files[i], &head, bytes);
+	int nparts;
+	if (usebounds && !cover) {
+		nparts = bounds_parts(parts, &bounds, mapbits);
+	} else {
+		struct level *biggest = NULL;
+		for (i = 0; i < nfiles; i++) {
+			if (biggest == NULL || files[i]->level.records > biggest->records) {
+				biggest = &files[i]->level;
+			}
 		}
+
+		int want = threads > 1 && !all ? 16 * threads : 1;
+		nparts = even_parts(parts, want, biggest, mapbits);
 	}
 
-	while (head != NULL) {
-		// The problem with this is that only the first component of
-		// each vector is indexed. We actually want all the tiles that
-		// the vector intersects, and could queue those by doing
-		// line drawing, except that the first component might not
-		// actually have the lowest tile number. How to fix?
+	if (!all) {
+		struct work w;
+		w.ds = ds;
+		w.nlevels = nfiles;
+		w.components = malloc(nfiles * sizeof(int));
+		w.zooms = malloc(nfiles * sizeof(int));
+		if (w.components == NULL || w.zooms == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
 
-		unsigned int x[head->components], y[head->components];
-		unsigned long long meta = 0;
-		buf2xys(head->buf, mapbits, metabits, head->zoom, head->components, x, y, &meta);
+		for (i = 0; i < nfiles; i++) {
+			w.components[i] = files[i]->components;
+			w.zooms[i] = files[i]->zoom;
+		}
 
-		if (all) {
-			dump_out(all, x, y, head->components, metabits, meta);
-		} else {
-			long long xx = x[0], yy = y[0];
+		w.parts = parts;
+		w.nparts = nparts;
+		w.next = 0;
+		w.listed = 0;
+		w.window = 4 * threads;
+		w.mapbits = mapbits;
+		w.maxzoom = maxzoom;
+		w.showdist = showdist;
+		w.cover = cover;
+		w.bounds = usebounds ? &bounds : NULL;
+		pthread_mutex_init(&w.lock, NULL);
+		pthread_cond_init(&w.cond, NULL);
+
+		for (i = 0; i < nfiles; i++) {
+			level_close(&files[i]->level);
+			free(files[i]);
+		}
 
-			handle(xx, yy, tile, fname, minzoom, maxzoom, showdist, x, y, files, sibling, verbose,
-			       usebounds ? &bounds : NULL);
+		pthread_t pool[threads];
+		for (i = 0; i < threads; i++) {
+			if (pthread_create(&pool[i], NULL, run_work, &w) != 0) {
+				perror("pthread_create");
+				exit(EXIT_FAILURE);
+			}
 		}
 
-		if (fread(head->buf, head->bytes, 1, head->f) != 1) {
-			memset(head->buf, 0xFF, bytes);
-			head->done = 1;
+		// With -c, the tiles crossed are collected from all the parts,
+		// since a line can cross tiles far from its first point
+		unsigned long long *cells = NULL;
+		long long ncells = 0, ncalloc = 0, sorted = 0;
+
+		size_read = 0;
+		for (i = 0; i < w.nparts; i++) {
+			struct part *p = &w.parts[i];
+
+			pthread_mutex_lock(&w.lock);
+			while (!p->done) {
+				pthread_cond_wait(&w.cond, &w.lock);
+			}
+			pthread_mutex_unlock(&w.lock);
+
+			long long j;
+			for (j = 0; j < p->nruns; j++) {
+				handle(&p->runs[j], tile, fname, minzoom, maxzoom, showdist, sibling, verbose, metatile);
+			}
+
+			if (ncells + p->ncells > ncalloc) {
+				if (ncells > 2 * sorted) {
+					ncells = sorted = uniq(cells, ncells);
+				}
+				while (ncells + p->ncells > ncalloc) {
+					ncalloc = ncalloc * 2 + 1024;
+				}
+				cells = realloc(cells, ncalloc * sizeof(unsigned long long));
+				if (cells == NULL) {
+					perror("realloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(cells + ncells, p->cells, p->ncells * sizeof(unsigned long long));
+			ncells += p->ncells;
+
+			free(p->runs);
+			free(p->cells);
+			size_read += p->read;
+
+			pthread_mutex_lock(&w.lock);
+			w.listed = i + 1;
+			pthread_cond_broadcast(&w.cond);
+			pthread_mutex_unlock(&w.lock);
+
+			if (size_total > 0 && 100 * size_read / size_total != size_progress) {
+				fprintf(stderr, "enumerate: %lld%% \r", 100 * size_read / size_total);
+				size_progress = 100 * size_read / size_total;
+			}
+		}
+
+		for (i = 0; i < threads; i++) {
+			if (pthread_join(pool[i], NULL) != 0) {
+				perror("pthread_join");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (cover) {
+			long long j;
+			int shift = 32 - maxzoom;
+
+			ncells = uniq(cells, ncells);
+			for (j = 0; j < ncells; j++) {
+				unsigned long long x = compact(cells[j]), y = compact(cells[j] >> 1);
+
+				struct run r;
+				r.x = x << shift;
+				r.y = y << shift;
+				r.count = 1;
+				r.xsum = r.x;
+				r.ysum = r.y;
+				r.dist = 0;
+
+				// Only tiles that overlap the bounds
+				if (((x + 1) << shift) - 1 < bounds.left || r.x > bounds.right ||
+				    ((y + 1) << shift) - 1 < bounds.top || r.y > bounds.bottom) {
+					r.count = 0;
+				}
+
+				handle(&r, tile, fname, minzoom, maxzoom, showdist, sibling, verbose, metatile);
+			}
+
+			free(cells);
+		}
+
+		handle(NULL, tile, fname, minzoom, maxzoom, showdist, sibling, verbose, metatile);
+
+		free(w.parts);
+		free(w.components);
+		free(w.zooms);
+		dataset_close(ds);
+		return 0;
+	}
+
+	// Dumping the records themselves still goes through them
+	// one at a time, in the order of their whole contents
+
+	dump_begin(all);
+
+	int k;
+	for (k = 0; k < nparts; k++) {
+		struct part *p = &parts[k];
+		struct file *head = NULL;
+
+		for (i = 0; i < nfiles; i++) {
+			files[i]->cursor = level_find(&files[i]->level, p->start);
+			files[i]->end = p->last ? files[i]->level.records : level_find(&files[i]->level, p->end);
+
+			if (nextrecord(files[i])) {
+				insert(files[i], &head, bytes);
+			}
+		}
+
+		while (head != NULL) {
+			unsigned int x[head->components], y[head->components];
+			unsigned long long meta = 0;
+			buf2xys(head->buf, mapbits, metabits, head->zoom, head->components, x, y, &meta);
+
+			if (!usebounds ||
+			    (x[0] >= bounds.left && x[0] <= bounds.right &&
+			     y[0] >= bounds.top && y[0] <= bounds.bottom)) {
+				dump_out(all, x, y, head->components, metabits, meta);
+			}
 
-			head = head->next;
-		} else {
 			size_read += head->bytes;
 
 			struct file *m = head;
 			head = m->next;
 			m->next = NULL;
 
-			insert(m, &head, bytes);
+			if (nextrecord(m)) {
+				insert(m, &head, bytes);
+			}
 
-			if (100 * size_read / size_total != size_progress) {
+			if (size_total > 0 && 100 * size_read / size_total != size_progress) {
 				fprintf(stderr, "enumerate: %lld%% \r", 100 * size_read / size_total);
 				size_progress = 100 * size_read / size_total;
 			}
 		}
 	}
 
-	if (all) {
-		dump_end(all);
-	} else {
-		handle(-1, -1, tile, fname, minzoom, maxzoom, showdist, NULL, NULL, files, sibling, verbose,
-		       usebounds ? &bounds : NULL);
-	}
+	dump_end(all);
 
 	return 0;
 }
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <ctype.h>
+#include "util.h"
+#include "dataset.h"
+#include "summary.h"
+#include "occupancy.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-b minlat,minlon,maxlat,maxlon] [-u tilelist] [-cs] [-i zoom] -o destdir file\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+// Records written out at once when they have to be decoded
+#define OUTBUF 65536
+
+#define MAX_RANGES 4096
+
+// The ranges below are of the first 64 bits of records, which start
+// with the bits of the first point, so each tile is one range of them.
+
+// The tiles that cover the bounds, or -1 if they aren't bounds
+static int bounds_ranges(struct range **ranges, int *n, int *nalloc, char *arg, int mapbits) {
+	double minlat, minlon, maxlat, maxlon;
+	unsigned int left, top, right, bottom;
+
+	if (sscanf(arg, "%lf,%lf,%lf,%lf", &minlat, &minlon, &maxlat, &maxlon) != 4) {
+		return -1;
+	}
+
+	latlon2tile(minlat, minlon, 32, &left, &bottom);
+	latlon2tile(maxlat, maxlon, 32, &right, &top);
+
+	struct range tiles[MAX_RANGES];
+	int ntiles = bounds2ranges(left, top, right, bottom, mapbits / 2, tiles, MAX_RANGES);
+	int i;
+
+	for (i = 0; i < ntiles; i++) {
+		appendrange(ranges, n, nalloc, tiles[i].start, tiles[i].end);
+	}
+
+	return ntiles;
+}
+
+// The tiles in a list like enumerate's, going by the last three words of each line
+static int list_ranges(struct range **ranges, int *n, int *nalloc, char *fname, int mapbits) {
+	FILE *f = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+	if (f == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	char s[2000];
+	long long line = 0;
+
+	while (fgets(s, sizeof(s), f) != NULL) {
+		line++;
+
+		char *cp = s + strlen(s);
+		int words = 0;
+		while (cp > s && words < 3) {
+			while (cp > s && isspace((unsigned char) cp[-1])) {
+				cp--;
+			}
+			while (cp > s && !isspace((unsigned char) cp[-1])) {
+				cp--;
+			}
+			words++;
+		}
+
+		int z;
+		unsigned int x, y;
+		if (sscanf(cp, "%d %u %u", &z, &x, &y) != 3) {
+			fprintf(stderr, "%s:%lld: not a tile: %s", fname, line, s);
+			exit(EXIT_FAILURE);
+		}
+		if (z < 0 || z > 32 || x >= (1LL << z) || y >= (1LL << z)) {
+			fprintf(stderr, "%s:%lld: no such tile: %s", fname, line, s);
+			exit(EXIT_FAILURE);
+		}
+
+		// Deeper than the dataset goes is the same as the tile it is in
+		if (z > mapbits / 2) {
+			x >>= z - mapbits / 2;
+			y >>= z - mapbits / 2;
+			z = mapbits / 2;
+		}
+
+		struct range r;
+		r.start = r.end = zxy2key(z, x, y);
+		range2keys(z, &r);
+		appendrange(ranges, n, nalloc, r.start, r.end);
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	return *n;
+}
+
+// Copy the records of one level whose first points are within the ranges.
+// A line at level z_lookup is all within one tile of that zoom, so it is
+// taken if that tile is anywhere within the ranges, even if its first
+// point isn't. Returns the number of records copied.
+static long long extract_level(struct dataset *ds, int components, int z_lookup, struct range *ranges, int nranges, char *outfname) {
+	struct level lv;
+
+	if (!level_open(ds, components, z_lookup, &lv)) {
+		return 0;
+	}
+
+	// The ranges, widened to whole tiles of the level's zoom.
+	// Points are only ever where they are.
+	unsigned long long low = 0;
+	if (components > 1 && z_lookup < 32) {
+		low = ~0ULL >> (2 * z_lookup);
+	}
+
+	struct range *wide = malloc((nranges + 1) * sizeof(struct range));
+	if (wide == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	int i, n;
+
+	for (i = 0; i < nranges; i++) {
+		wide[i].start = ranges[i].start & ~low;
+		wide[i].end = ranges[i].end | low;
+	}
+	n = joinranges(wide, nranges);
+
+	FILE *out = NULL;
+	unsigned char *buf = NULL;
+	long long copied = 0;
+
+	for (i = 0; i < n; i++) {
+		long long first = level_find(&lv, wide[i].start);
+		long long last = wide[i].end == ~0ULL ? lv.records : level_find(&lv, wide[i].end + 1);
+
+		if (first >= last) {
+			continue;
+		}
+
+		if (out == NULL) {
+			out = fopen(outfname, "wb");
+			if (out == NULL) {
+				perror(outfname);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (!lv.compressed && !lv.split) {
+			// The records are all right there in order, so the whole
+			// stretch can be written at once
+
+			level_advise(&lv, first, last - 1, POSIX_MADV_SEQUENTIAL, 0);
+			if (fwrite(lv.map.data + first * lv.bytes, lv.bytes, last - first, out) != last - first) {
+				perror(outfname);
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			int bytes = lv.split ? lv.fullbytes : lv.bytes;
+			long long j;
+			size_t used = 0;
+
+			if (buf == NULL) {
+				buf = malloc((size_t) OUTBUF * bytes);
+				if (buf == NULL) {
+					perror("malloc");
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			level_advise(&lv, first, last - 1, POSIX_MADV_SEQUENTIAL, 1);
+			for (j = first; j < last; j++) {
+				if (used == OUTBUF) {
+					if (fwrite(buf, bytes, used, out) != used) {
+						perror(outfname);
+						exit(EXIT_FAILURE);
+					}
+					used = 0;
+				}
+
+				memcpy(buf + used * bytes, level_full_record(&lv, j), bytes);
+				used++;
+			}
+
+			if (fwrite(buf, bytes, used, out) != used) {
+				perror(outfname);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		copied += last - first;
+	}
+
+	if (out != NULL && fclose(out) != 0) {
+		perror(outfname);
+		exit(EXIT_FAILURE);
+	}
+
+	free(buf);
+	free(wide);
+	level_close(&lv);
+	return copied;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	char *destdir = NULL;
+	char *bounds = NULL;
+	char *tilelist = NULL;
+	int compress = 0;
+	int split = 0;
+	int occzoom = -1;
+
+	while ((i = getopt(argc, argv, "b:u:o:csi:")) != -1) {
+		switch (i) {
+		case 'b':
+			bounds = optarg;
+			break;
+
+		case 'u':
+			tilelist = optarg;
+			break;
+
+		case 'o':
+			destdir = optarg;
+			break;
+
+		case 'c':
+			compress = 1;
+			break;
+
+		case 's':
+			split = 1;
+			break;
+
+		case 'i':
+			occzoom = atoi(optarg);
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (argc - optind != 1 || destdir == NULL || (bounds == NULL && tilelist == NULL)) {
+		usage(argv);
+	}
+
+	struct dataset *ds = dataset_open(argv[optind]);
+	int mapbits = ds->mapbits, metabits = ds->metabits;
+
+	struct range *ranges = NULL;
+	int nranges = 0, nalloc = 0;
+
+	if (bounds != NULL) {
+		if (bounds_ranges(&ranges, &nranges, &nalloc, bounds, mapbits) < 0) {
+			fprintf(stderr, "%s: -b must be minlat,minlon,maxlat,maxlon\n", argv[0]);
+			usage(argv);
+		}
+	}
+	if (tilelist != NULL) {
+		list_ranges(&ranges, &nranges, &nalloc, tilelist, mapbits);
+	}
+	nranges = joinranges(ranges, nranges);
+
+	if (mkdir(destdir, 0777) != 0) {
+		perror(destdir);
+		exit(EXIT_FAILURE);
+	}
+
+	// Without any metadata there is nothing to split off
+	if (metabits == 0) {
+		split = 0;
+	}
+
+	int flags = (compress ? DATASET_COMPRESSED : 0) | (split ? DATASET_SPLIT : 0);
+	dataset_write_meta(destdir, mapbits, metabits, ds->maxn, flags);
+
+	long long total = 0;
+	int z_lookup;
+	for (z_lookup = 0; z_lookup <= mapbits / 2; z_lookup++) {
+		for (i = 1; i <= ds->maxn; i++) {
+			if (i == 1 && z_lookup != 0) {
+				continue;
+			}
+
+			char outfname[strlen(destdir) + 1 + 5 + 1 + 5 + 1];
+			sprintf(outfname, "%s/%d,%d", destdir, i, z_lookup);
+
+			long long copied = extract_level(ds, i, z_lookup, ranges, nranges, outfname);
+			if (copied == 0) {
+				continue;
+			}
+
+			int bytes = bytesfor(mapbits, metabits, i, z_lookup);
+			printf("extracted %lld records of zoom level %d for point count %d (%d bytes)\n", copied, z_lookup, i, bytes);
+			total += copied;
+
+			level_finish(outfname, mapbits, metabits, i, z_lookup, flags);
+		}
+	}
+
+	// The zoom the dataset is encoded for, as encode does,
+	// but never below 0 whatever mapbits the input has
+	if (occzoom < 0) {
+		occzoom = mapbits / 2 - 8;
+		if (occzoom < 0) {
+			occzoom = 0;
+		}
+	}
+	occupancy_write(destdir, occzoom);
+
+	fprintf(stderr, "%lld records in %d ranges\n", total, nranges);
+
+	free(ranges);
+	dataset_close(ds);
+	return 0;
+}
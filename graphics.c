@@ -13,6 +13,29 @@ static void fail(png_structp png_ptr, png_const_charp error_msg) {
 	exit(EXIT_FAILURE);
 }
 
+// A brush, already spread across pixel boundaries for each of
+// SUBPIXEL x SUBPIXEL fractional positions, so that a whole brush
+// can be added into the image a row at a time. Each kernel is only
+// made the first time a point lands at that fractional position.
+
+#define SUBPIXEL 8
+
+struct brush {
+	int size;		// quantized area, see brushsize()
+	int gaussian;
+	int width;
+	double area;
+	double *cells;
+	double *kernels[SUBPIXEL * SUBPIXEL];
+};
+
+// Brushes of recently used sizes, so that -x r doesn't rebuild
+// one for nearly every point. Direct-mapped by size, and the
+// kernels are all thrown away if they grow past BRUSH_MEMORY.
+
+#define BRUSH_CACHE 256
+#define BRUSH_MEMORY (64 * 1024 * 1024)
+
 struct graphics {
 	int width;
 	int height;
@@ -24,6 +47,15 @@ struct graphics {
 	int clipy;
 	int clipwidth;
 	int clipheight;
+
+	struct brush *brushes[BRUSH_CACHE];
+	long long brushmemory;
+
+	// Coverage accumulation for thick lines, see fillPolygon().
+	// Allocated the first time it is needed, and kept zeroed.
+	double *acc;
+	int *accleft;
+	int *accright;
 };
 
 struct graphics *graphics_init(int width, int height, char **filetype) {
@@ -44,11 +76,103 @@ struct graphics *graphics_init(int width, int height, char **filetype) {
 	g->clipwidth = INT_MAX;
 	g->clipheight = INT_MAX;
 
+	memset(g->brushes, '\0', sizeof(g->brushes));
+	g->brushmemory = 0;
+
+	g->acc = NULL;
+	g->accleft = NULL;
+	g->accright = NULL;
+
 	*filetype = "png";
 	return g;
 }
 
-void out(struct graphics *gc, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie) {
+// A blank image the same size as gc, so that another thread can
+// draw into it at the same time as gc is being drawn into.
+struct graphics *graphics_plane(struct graphics *gc) {
+	char *filetype;
+	struct graphics *g = graphics_init(gc->width, gc->height, &filetype);
+
+	g->clipx = gc->clipx;
+	g->clipy = gc->clipy;
+	g->clipwidth = gc->clipwidth;
+	g->clipheight = gc->clipheight;
+
+	return g;
+}
+
+static void freeBrush(struct graphics *g, struct brush *b);
+
+void graphics_free(struct graphics *gc) {
+	int i;
+
+	for (i = 0; i < BRUSH_CACHE; i++) {
+		if (gc->brushes[i] != NULL) {
+			freeBrush(gc, gc->brushes[i]);
+		}
+	}
+
+	free(gc->image);
+	free(gc->cx);
+	free(gc->cy);
+	free(gc->acc);
+	free(gc->accleft);
+	free(gc->accright);
+	free(gc);
+}
+
+// Add a plane from graphics_plane() back into gc, and free it
+void graphics_merge(struct graphics *gc, struct graphics *plane) {
+	int i;
+
+	for (i = 0; i < gc->width * gc->height; i++) {
+		gc->image[i] += plane->image[i];
+		gc->cx[i] += plane->cx[i];
+		gc->cy[i] += plane->cy[i];
+	}
+
+	graphics_free(plane);
+}
+
+// A copy of a piece of gc, to cut a metatile into tiles
+struct graphics *graphics_crop(struct graphics *gc, int x, int y, int width, int height) {
+	char *filetype;
+	struct graphics *g = graphics_init(width, height, &filetype);
+	int yy;
+
+	for (yy = 0; yy < height; yy++) {
+		if (y + yy >= 0 && y + yy < gc->height && x >= 0 && x + width <= gc->width) {
+			int off = (y + yy) * gc->width + x;
+
+			memcpy(g->image + yy * width, gc->image + off, width * sizeof(double));
+			memcpy(g->cx + yy * width, gc->cx + off, width * sizeof(double));
+			memcpy(g->cy + yy * width, gc->cy + off, width * sizeof(double));
+		}
+	}
+
+	return g;
+}
+
+// Whether nothing at all has been drawn into gc
+int graphics_blank(struct graphics *gc) {
+	int i;
+
+	for (i = 0; i < gc->width * gc->height; i++) {
+		if (gc->image[i] != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Pixels only depend on the metadata through the brightness and hue
+// that the caller works out from it
+int graphics_wants_meta(struct graphics *gc) {
+	return 0;
+}
+
+void out(struct graphics *gc, FILE *fp, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie) {
 	unsigned char *buf = malloc(gc->width * gc->height * 4);
 
 	int midr, midg, midb;
@@ -211,7 +335,7 @@ void out(struct graphics *gc, int transparency, double gamma, int invert, int bg
 
 	png_set_IHDR(png_ptr, info_ptr, gc->width, gc->height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 	png_set_rows(png_ptr, info_ptr, rows);
-	png_init_io(png_ptr, stdout);
+	png_init_io(png_ptr, fp);
 	png_write_png(png_ptr, info_ptr, 0, NULL);
 	png_destroy_write_struct(&png_ptr, &info_ptr);
 
@@ -336,34 +460,270 @@ static void antialiasedLine(double x0, double y0, double x1, double y1, struct g
 	}
 }
 
-static void antialiasedLineThick(double x0, double y0, double x1, double y1, struct graphics *g, double bright, double hue, double thick) {
-	if (thick <= 1) {
-		antialiasedLine(x0, y0, x1, y1, g, bright * thick, hue);
+// Signed-area coverage, along the lines of
+// https://medium.com/@raphlinus/inside-the-fastest-font-renderer-in-the-world-75ae5270c445
+//
+// Each edge adds, to the cells of each row that it crosses, the change
+// in coverage that it causes. Adding up a row from left to right then
+// gives the area of each pixel that is inside the polygon.
+//
+// The stride is width + 2 because an edge at the right edge of the
+// image still writes one or two cells beyond it.
+
+static void accumulateEdge(struct graphics *g, double x0, double y0, double x1, double y1, int ymin, int ymax) {
+	if (y0 == y1) {
 		return;
 	}
 
-	antialiasedLine(x0, y0, x1, y1, g, bright, hue);
-	int off = 1;
-	thick--;
+	double dir = 1;
+	if (y0 > y1) {
+		double tmp = x0;
+		x0 = x1;
+		x1 = tmp;
+
+		tmp = y0;
+		y0 = y1;
+		y1 = tmp;
+
+		dir = -1;
+	}
+
+	double dxdy = (x1 - x0) / (y1 - y0);
+	double x = x0;
+
+	if (y0 < ymin) {
+		x += (ymin - y0) * dxdy;
+		y0 = ymin;
+	}
+	if (y1 > ymax) {
+		y1 = ymax;
+	}
+
+	int stride = g->width + 2;
+	int y;
+	for (y = floor(y0); y < y1; y++) {
+		double *row = g->acc + y * stride;
+		double dy = ((y + 1 < y1) ? y + 1 : y1) - ((y > y0) ? y : y0);
+		double xnext = x + dxdy * dy;
+		double d = dy * dir;
+
+		double xa = x, xb = xnext;
+		if (xa > xb) {
+			xa = xnext;
+			xb = x;
+		}
 
-	double angle = atan2(y1 - y0, x1 - x0) + M_PI / 2;
-	double c = cos(angle);
-	double s = sin(angle);
+		int xai = floor(xa);
+		int xbi = ceil(xb);
 
-	while (thick > 0) {
-		if (thick >= 2) {
-			antialiasedLine(x0 + c * off, y0 + s * off, x1 + c * off, y1 + s * off, g, bright, hue);
-			antialiasedLine(x0 - c * off, y0 - s * off, x1 - c * off, y1 - s * off, g, bright, hue);
+		if (xai < g->accleft[y]) {
+			g->accleft[y] = xai;
+		}
+
+		if (xbi <= xai + 1) {
+			double xmf = .5 * (x + xnext) - xai;
+			row[xai] += d - d * xmf;
+			row[xai + 1] += d * xmf;
+
+			if (xai + 1 > g->accright[y]) {
+				g->accright[y] = xai + 1;
+			}
 		} else {
-			antialiasedLine(x0 + c * (off - 1 + thick / 2), y0 + s * (off - 1 + thick / 2),
-					x1 + c * (off - 1 + thick / 2), y1 + s * (off - 1 + thick / 2), g, bright * thick / 2, hue);
-			antialiasedLine(x0 - c * (off - 1 + thick / 2), y0 - s * (off - 1 + thick / 2),
-					x1 - c * (off - 1 + thick / 2), y1 - s * (off - 1 + thick / 2), g, bright * thick / 2, hue);
+			double s = 1 / (xb - xa);
+			double xaf = xa - xai;
+			double a0 = .5 * s * (1 - xaf) * (1 - xaf);
+			double xbf = xb - xbi + 1;
+			double am = .5 * s * xbf * xbf;
+
+			row[xai] += d * a0;
+
+			if (xbi == xai + 2) {
+				row[xai + 1] += d * (1 - a0 - am);
+			} else {
+				double a1 = s * (1.5 - xaf);
+				row[xai + 1] += d * (a1 - a0);
+
+				int xi;
+				for (xi = xai + 2; xi < xbi - 1; xi++) {
+					row[xi] += d * s;
+				}
+
+				double a2 = a1 + (xbi - xai - 3) * s;
+				row[xbi - 1] += d * (1 - a2 - am);
+			}
+
+			row[xbi] += d * am;
+
+			if (xbi > g->accright[y]) {
+				g->accright[y] = xbi;
+			}
+		}
+
+		x = xnext;
+	}
+}
+
+// Parts of edges that are off the left of the drawing area still
+// count toward the coverage of the pixels to their right, so they
+// are moved to its edge instead of being thrown away. Parts off
+// the right can't affect anything.
+
+static void clampEdge(struct graphics *g, double x0, double y0, double x1, double y1, int xmin, int xmax, int ymin, int ymax) {
+	double bound[2] = { xmin, xmax };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if ((x0 < bound[i] && x1 > bound[i]) || (x0 > bound[i] && x1 < bound[i])) {
+			double y = y0 + (y1 - y0) * (bound[i] - x0) / (x1 - x0);
+
+			clampEdge(g, x0, y0, bound[i], y, xmin, xmax, ymin, ymax);
+			clampEdge(g, bound[i], y, x1, y1, xmin, xmax, ymin, ymax);
+			return;
 		}
+	}
 
-		thick -= 2;
-		off++;
+	if (x0 < xmin) {
+		x0 = xmin;
+	}
+	if (x1 < xmin) {
+		x1 = xmin;
+	}
+	if (x0 > xmax) {
+		x0 = xmax;
 	}
+	if (x1 > xmax) {
+		x1 = xmax;
+	}
+
+	accumulateEdge(g, x0, y0, x1, y1, ymin, ymax);
+}
+
+static void fillPolygon(struct graphics *g, double *x, double *y, int n, double bright, double hue) {
+	int xmin = 0, ymin = 0;
+	int xmax = g->width, ymax = g->height;
+
+	if (xmin < g->clipx) {
+		xmin = g->clipx;
+	}
+	if (ymin < g->clipy) {
+		ymin = g->clipy;
+	}
+	if ((long long) g->clipx + g->clipwidth < xmax) {
+		xmax = g->clipx + g->clipwidth;
+	}
+	if ((long long) g->clipy + g->clipheight < ymax) {
+		ymax = g->clipy + g->clipheight;
+	}
+
+	double top = y[0], bottom = y[0], left = x[0], right = x[0];
+	int i;
+	for (i = 1; i < n; i++) {
+		if (x[i] > right) {
+			right = x[i];
+		}
+		if (y[i] < top) {
+			top = y[i];
+		}
+		if (y[i] > bottom) {
+			bottom = y[i];
+		}
+		if (x[i] < left) {
+			left = x[i];
+		}
+	}
+
+	if (top < ymin) {
+		top = ymin;
+	}
+	if (bottom > ymax) {
+		bottom = ymax;
+	}
+	if (top >= bottom || left >= xmax || right <= xmin) {
+		return;
+	}
+
+	if (g->acc == NULL) {
+		g->acc = calloc((g->width + 2) * g->height, sizeof(double));
+		g->accleft = malloc(g->height * sizeof(int));
+		g->accright = malloc(g->height * sizeof(int));
+
+		if (g->acc == NULL || g->accleft == NULL || g->accright == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int y0 = floor(top);
+	int y1 = ceil(bottom);
+	int yy;
+
+	for (yy = y0; yy < y1; yy++) {
+		g->accleft[yy] = INT_MAX;
+		g->accright[yy] = INT_MIN;
+	}
+
+	for (i = 0; i < n; i++) {
+		int j = (i + 1) % n;
+		clampEdge(g, x[i], y[i], x[j], y[j], xmin, xmax, ymin, ymax);
+	}
+
+	double hx = 0, hy = 0;
+	if (hue >= 0) {
+		hx = bright * cos(hue * 2 * M_PI);
+		hy = bright * sin(hue * 2 * M_PI);
+	}
+
+	int stride = g->width + 2;
+	for (yy = y0; yy < y1; yy++) {
+		double *row = g->acc + yy * stride;
+		double sum = 0;
+		int xx;
+
+		if (g->accleft[yy] > g->accright[yy]) {
+			continue;
+		}
+
+		for (xx = g->accleft[yy]; xx <= g->accright[yy]; xx++) {
+			sum += row[xx];
+			row[xx] = 0;
+
+			if (xx < xmax) {
+				double cover = fabs(sum);
+				if (cover > 1) {
+					cover = 1;
+				}
+
+				int off = yy * g->width + xx;
+				g->image[off] += cover * bright;
+
+				if (hue >= 0) {
+					g->cx[off] += cover * hx;
+					g->cy[off] += cover * hy;
+				}
+			}
+		}
+	}
+}
+
+static void antialiasedLineThick(double x0, double y0, double x1, double y1, struct graphics *g, double bright, double hue, double thick) {
+	if (thick <= 1) {
+		antialiasedLine(x0, y0, x1, y1, g, bright * thick, hue);
+		return;
+	}
+
+	double len = sqrt((x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0));
+	if (len == 0) {
+		return;
+	}
+
+	// The rectangle around the line, thick wide
+	double nx = -(y1 - y0) / len * thick / 2;
+	double ny = (x1 - x0) / len * thick / 2;
+
+	double x[4] = { x0 + nx, x1 + nx, x1 - nx, x0 - nx };
+	double y[4] = { y0 + ny, y1 + ny, y1 - ny, y0 - ny };
+
+	fillPolygon(g, x, y, 4, bright, hue);
 }
 
 // http://rosettacode.org/wiki/Bitmap/Bresenham's_line_algorithm#C
@@ -421,97 +781,377 @@ void drawPixel(double x, double y, struct graphics *g, double bright, double hue
 	putPixel(x + 1, y + 1, bright *  fpart(x) *  fpart(y), g, hue);
 }
 
-static double thebrush = -1;
-static int brushwidth = -1;
-static int thegaussian = -1;
-static double *brushbytes = NULL;
+static void makeKernel(double *brush, int width, int qx, int qy, double *k) {
+	int kwidth = width + 1;
+	memset(k, '\0', kwidth * kwidth * sizeof(double));
 
-void drawBrush(double x, double y, struct graphics *g, double bright, double brush, double hue, long long meta, int gaussian, struct tilecontext *tc) {
-	if (brush != thebrush || gaussian != thegaussian) {
-		free(brushbytes);
-		thebrush = brush;
-		thegaussian = gaussian;
+	double fx = (double) qx / SUBPIXEL;
+	double fy = (double) qy / SUBPIXEL;
 
-#define MULT 9
+	// Same weights that drawPixel() gives each brush cell
+	int xx, yy;
+	for (yy = 0; yy < width; yy++) {
+		for (xx = 0; xx < width; xx++) {
+			double v = brush[yy * width + xx];
+
+			k[yy * kwidth + xx]           += v * (1 - fx) * (1 - fy);
+			k[yy * kwidth + xx + 1]       += v *      fx  * (1 - fy);
+			k[(yy + 1) * kwidth + xx]     += v * (1 - fx) *      fy;
+			k[(yy + 1) * kwidth + xx + 1] += v *      fx  *      fy;
+		}
+	}
+}
 
-		double radius = MULT * sqrt(brush / M_PI);
-		int bigwidth = 2 * ceil(radius / MULT) * MULT + MULT;
-		int mid = bigwidth / 2;
-		brushwidth = bigwidth / MULT;
+// Kept separate so that the compiler will vectorize it
+static void addRow(double *restrict dest, const double *restrict src, double scale, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		dest[i] += src[i] * scale;
+	}
+}
 
-		double *temp = malloc(bigwidth * bigwidth * sizeof(double));
-		memset(temp, '\0', bigwidth * bigwidth * sizeof(double));
+// Brush areas are quantized to 1/64 of a doubling (about 1%)
+// so that nearby sizes can share a brush. The difference in
+// total brightness is made up when the brush is drawn.
 
-		double sum = 0;
-		int xa;
-		for (xa = mid - floor(radius); xa <= mid + floor(radius); xa++) {
-			double dx = acos((xa - mid) / radius);
-			double yy = floor(fabs(sin(dx)) * radius);
+#define BRUSH_STEPS 64
+
+static int brushsize(double brush) {
+	return floor(log(brush) / log(2) * BRUSH_STEPS + .5);
+}
+
+static void freeKernels(struct graphics *g, struct brush *b) {
+	int i;
+	for (i = 0; i < SUBPIXEL * SUBPIXEL; i++) {
+		if (b->kernels[i] != NULL) {
+			free(b->kernels[i]);
+			b->kernels[i] = NULL;
+			g->brushmemory -= (b->width + 1) * (b->width + 1) * sizeof(double);
+		}
+	}
+}
+
+static void freeBrush(struct graphics *g, struct brush *b) {
+	freeKernels(g, b);
+	free(b->cells);
+	free(b);
+}
+
+static struct brush *makeBrush(int size, int gaussian) {
+	struct brush *b = malloc(sizeof(struct brush));
+	if (b == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	double brush = exp(log(2) * size / BRUSH_STEPS);
+
+	b->size = size;
+	b->gaussian = gaussian;
+	b->area = brush;
+	memset(b->kernels, '\0', sizeof(b->kernels));
+
+#define MULT 9
+
+	double radius = MULT * sqrt(brush / M_PI);
+	int bigwidth = 2 * ceil(radius / MULT) * MULT + MULT;
+	int mid = bigwidth / 2;
+	int width = bigwidth / MULT;
+	b->width = width;
 
-			int ya;
-			for (ya = mid - yy; ya <= mid + yy; ya++) {
-				int y1 = ya;
-				int x1 = xa;
+	double *temp = malloc(bigwidth * bigwidth * sizeof(double));
+	memset(temp, '\0', bigwidth * bigwidth * sizeof(double));
 
-				if (y1 >= 0 && y1 < bigwidth && x1 >= 0 && x1 < bigwidth) {
-					double inc = 1;
+	double sum = 0;
+	int xa;
+	for (xa = mid - floor(radius); xa <= mid + floor(radius); xa++) {
+		double dx = acos((xa - mid) / radius);
+		double yy = floor(fabs(sin(dx)) * radius);
 
-					if (gaussian) {
-						double xx = (xa - mid) / radius;
-						double yy = (ya - mid) / radius;
-						double d = sqrt(xx * xx + yy * yy);
+		int ya;
+		for (ya = mid - yy; ya <= mid + yy; ya++) {
+			int y1 = ya;
+			int x1 = xa;
 
-						inc = exp(-(d * d) / (2.0 / (3.0 * 3.0)));
-					}
+			if (y1 >= 0 && y1 < bigwidth && x1 >= 0 && x1 < bigwidth) {
+				double inc = 1;
 
-					temp[bigwidth * y1 + x1] = inc;
-					sum += inc;
+				if (gaussian) {
+					double xx = (xa - mid) / radius;
+					double yy = (ya - mid) / radius;
+					double d = sqrt(xx * xx + yy * yy);
+
+					inc = exp(-(d * d) / (2.0 / (3.0 * 3.0)));
 				}
+
+				temp[bigwidth * y1 + x1] = inc;
+				sum += inc;
 			}
 		}
+	}
 
-		brushbytes = malloc(brushwidth * brushwidth * sizeof(double));
-		memset(brushbytes, '\0', brushwidth * brushwidth * sizeof(double));
+	b->cells = malloc(width * width * sizeof(double));
+	memset(b->cells, '\0', width * width * sizeof(double));
 
-		for (xa = 0; xa < bigwidth; xa++) {
-			int ya;
-			for (ya = 0; ya < bigwidth; ya++) {
-				brushbytes[xa / MULT + (ya / MULT) * brushwidth] += temp[xa + ya * bigwidth];
-			}
+	for (xa = 0; xa < bigwidth; xa++) {
+		int ya;
+		for (ya = 0; ya < bigwidth; ya++) {
+			b->cells[xa / MULT + (ya / MULT) * width] += temp[xa + ya * bigwidth];
 		}
+	}
+
+	// Also fold in the division that used to happen per pixel
+	double scale = brush / (double) sum;
+
+	for (xa = 0; xa < width * width; xa++) {
+		b->cells[xa] *= scale;
+	}
 
-		double scale = MULT * MULT * brush / (double) sum;
+	free(temp);
+	return b;
+}
+
+static struct brush *getBrush(struct graphics *g, double brush, int gaussian) {
+	int size = brushsize(brush);
+	int slot = ((unsigned) size * 2 + (gaussian != 0)) % BRUSH_CACHE;
+	struct brush *b = g->brushes[slot];
 
-		for (xa = 0; xa < brushwidth * brushwidth; xa++) {
-			brushbytes[xa] *= scale;
+	if (b == NULL || b->size != size || b->gaussian != gaussian) {
+		if (b != NULL) {
+			freeBrush(g, b);
 		}
 
-		free(temp);
+		b = g->brushes[slot] = makeBrush(size, gaussian);
 	}
 
+	return b;
+}
+
+void drawBrush(double x, double y, struct graphics *g, double bright, double brush, double hue, long long meta, int gaussian, struct tilecontext *tc) {
+	struct brush *b = getBrush(g, brush, gaussian);
+	int brushwidth = b->width;
+
+	bright *= brush / b->area;
+
 	// match where single pixels are drawn
 	x -= ceil(brushwidth / 2) + .5;
 	y -= ceil(brushwidth / 2) + .5;
 
-	int width = brushwidth;
-
-	if (x + width < 0) {
+	if (x + brushwidth < 0) {
 		return;
 	}
-	if (y + width < 0) {
+	if (y + brushwidth < 0) {
 		return;
 	}
-	if (x - width > g->width) {
+	if (x - brushwidth > g->width) {
 		return;
 	}
-	if (y - width > g->height) {
+	if (y - brushwidth > g->height) {
 		return;
 	}
 
-	int xx, yy;
-	for (xx = 0; xx < width; xx++) {
-		for (yy = 0; yy < width; yy++) {
-			drawPixel(x + xx, y + yy, g, brushbytes[yy * width + xx] * bright / (MULT * MULT), hue, meta, tc);
+	// Pick the kernel for the nearest subpixel offset
+
+	int ix = floor(x);
+	int iy = floor(y);
+	int qx = floor((x - ix) * SUBPIXEL + .5);
+	int qy = floor((y - iy) * SUBPIXEL + .5);
+
+	if (qx == SUBPIXEL) {
+		ix++;
+		qx = 0;
+	}
+	if (qy == SUBPIXEL) {
+		iy++;
+		qy = 0;
+	}
+
+	int kwidth = brushwidth + 1;
+	double *k = b->kernels[qy * SUBPIXEL + qx];
+
+	if (k == NULL) {
+		if (g->brushmemory + kwidth * kwidth * sizeof(double) > BRUSH_MEMORY) {
+			int i;
+			for (i = 0; i < BRUSH_CACHE; i++) {
+				if (g->brushes[i] != NULL) {
+					freeKernels(g, g->brushes[i]);
+				}
+			}
+		}
+
+		k = b->kernels[qy * SUBPIXEL + qx] = malloc(kwidth * kwidth * sizeof(double));
+		g->brushmemory += kwidth * kwidth * sizeof(double);
+		if (k == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		makeKernel(b->cells, brushwidth, qx, qy, k);
+	}
+
+	// Clip the whole brush once against the image and the clip rectangle
+
+	int x0 = ix, y0 = iy;
+	int x1 = ix + kwidth, y1 = iy + kwidth;
+
+	if (x0 < 0) {
+		x0 = 0;
+	}
+	if (y0 < 0) {
+		y0 = 0;
+	}
+	if (x0 < g->clipx) {
+		x0 = g->clipx;
+	}
+	if (y0 < g->clipy) {
+		y0 = g->clipy;
+	}
+	if (x1 > g->width) {
+		x1 = g->width;
+	}
+	if (y1 > g->height) {
+		y1 = g->height;
+	}
+	if ((long long) g->clipx + g->clipwidth < x1) {
+		x1 = g->clipx + g->clipwidth;
+	}
+	if ((long long) g->clipy + g->clipheight < y1) {
+		y1 = g->clipy + g->clipheight;
+	}
+
+	if (x0 >= x1 || y0 >= y1) {
+		return;
+	}
+
+	double hx = 0, hy = 0;
+	if (hue >= 0) {
+		hx = bright * cos(hue * 2 * M_PI);
+		hy = bright * sin(hue * 2 * M_PI);
+	}
+
+	int yy;
+	for (yy = y0; yy < y1; yy++) {
+		double *row = k + (yy - iy) * kwidth + (x0 - ix);
+		int off = yy * g->width + x0;
+
+		addRow(g->image + off, row, bright, x1 - x0);
+
+		if (hue >= 0) {
+			addRow(g->cx + off, row, hx, x1 - x0);
+			addRow(g->cy + off, row, hy, x1 - x0);
+		}
+	}
+}
+
+// A disk of even density, with its edges antialiased by
+// looking at several rows within each row of pixels.
+
+#define DISK_ROWS 4
+
+void drawDisk(double x, double y, struct graphics *g, double bright, double radius, double hue, long long meta, struct tilecontext *tc) {
+	int xmin = 0, ymin = 0;
+	int xmax = g->width, ymax = g->height;
+
+	if (xmin < g->clipx) {
+		xmin = g->clipx;
+	}
+	if (ymin < g->clipy) {
+		ymin = g->clipy;
+	}
+	if ((long long) g->clipx + g->clipwidth < xmax) {
+		xmax = g->clipx + g->clipwidth;
+	}
+	if ((long long) g->clipy + g->clipheight < ymax) {
+		ymax = g->clipy + g->clipheight;
+	}
+
+	if (x + radius < xmin || x - radius > xmax || y + radius < ymin || y - radius > ymax) {
+		return;
+	}
+
+	int y0 = floor(y - radius);
+	int y1 = ceil(y + radius);
+	if (y0 < ymin) {
+		y0 = ymin;
+	}
+	if (y1 > ymax) {
+		y1 = ymax;
+	}
+
+	double hx = 0, hy = 0;
+	if (hue >= 0) {
+		hx = cos(hue * 2 * M_PI);
+		hy = sin(hue * 2 * M_PI);
+	}
+
+	double row[xmax - xmin + 1];
+	int yy;
+	for (yy = y0; yy < y1; yy++) {
+		double a[DISK_ROWS], b[DISK_ROWS];
+		int n = 0;
+		int left = INT_MAX, right = INT_MIN;
+		int s, xx;
+
+		for (s = 0; s < DISK_ROWS; s++) {
+			double dy = yy + (s + .5) / DISK_ROWS - y;
+			if (dy * dy >= radius * radius) {
+				continue;
+			}
+
+			double dx = sqrt(radius * radius - dy * dy);
+			a[n] = x - dx;
+			b[n] = x + dx;
+
+			if (a[n] < xmin) {
+				a[n] = xmin;
+			}
+			if (b[n] > xmax) {
+				b[n] = xmax;
+			}
+			if (a[n] >= b[n]) {
+				continue;
+			}
+
+			if (floor(a[n]) < left) {
+				left = floor(a[n]);
+			}
+			if (ceil(b[n]) - 1 > right) {
+				right = ceil(b[n]) - 1;
+			}
+
+			n++;
+		}
+
+		if (n == 0) {
+			continue;
+		}
+
+		for (xx = left; xx <= right; xx++) {
+			row[xx - xmin] = 0;
+		}
+
+		for (s = 0; s < n; s++) {
+			int ia = floor(a[s]);
+			int ib = ceil(b[s]) - 1;
+
+			if (ia == ib) {
+				row[ia - xmin] += (b[s] - a[s]) / DISK_ROWS;
+			} else {
+				row[ia - xmin] += (ia + 1 - a[s]) / DISK_ROWS;
+				for (xx = ia + 1; xx < ib; xx++) {
+					row[xx - xmin] += 1.0 / DISK_ROWS;
+				}
+				row[ib - xmin] += (b[s] - ib) / DISK_ROWS;
+			}
+		}
+
+		int off = yy * g->width + left;
+
+		addRow(g->image + off, row + (left - xmin), bright, right - left + 1);
+
+		if (hue >= 0) {
+			addRow(g->cx + off, row + (left - xmin), bright * hx, right - left + 1);
+			addRow(g->cy + off, row + (left - xmin), bright * hy, right - left + 1);
 		}
 	}
 }
@@ -10,9 +10,16 @@ struct tilecontext {
 };
 
 struct graphics *graphics_init(int width, int height, char **filetype);
-void out(struct graphics *graphics, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie);
+struct graphics *graphics_plane(struct graphics *gc);
+void graphics_merge(struct graphics *gc, struct graphics *plane);
+struct graphics *graphics_crop(struct graphics *gc, int x, int y, int width, int height);
+int graphics_blank(struct graphics *gc);
+int graphics_wants_meta(struct graphics *gc);
+void graphics_free(struct graphics *gc);
+void out(struct graphics *graphics, FILE *fp, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie);
 
 int drawClip(double x0, double y0, double x1, double y1, struct graphics *graphics, double bright, double hue, long long meta, int antialias, double thick, struct tilecontext *tc);
 void drawPixel(double x, double y, struct graphics *graphics, double bright, double hue, long long meta, struct tilecontext *tc);
 void drawBrush(double x, double y, struct graphics *graphics, double bright, double brush, double hue, long long meta, int gaussian, struct tilecontext *tc);
+void drawDisk(double x, double y, struct graphics *graphics, double bright, double radius, double hue, long long meta, struct tilecontext *tc);
 void setClip(struct graphics *gc, int x, int y, int w, int h);
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "dedup.h"
+#include "mbtiles.h"
+
+// Tiles waiting for the writer. The ones that put them wait
+// if there are already QUEUE_MAX, so memory stays bounded.
+
+#define QUEUE_MAX 256
+
+// Rows per transaction. A transaction is also committed when the
+// writer has been idle for a second, so that other processes writing
+// the same file aren't locked out for long.
+
+#define BATCH 1000
+
+struct pending {
+	int z;
+	unsigned int x;
+	unsigned int y;
+	void *data;
+	size_t len;
+	unsigned long long hash;
+
+	struct pending *next;
+};
+
+struct mbtiles {
+	char *fname;
+	sqlite3 *db;
+	sqlite3_stmt *insert;
+
+	// With dedup, insert goes into map, and the images are
+	// looked up and added by these
+	int dedup;
+	sqlite3_stmt *lookup;
+	sqlite3_stmt *image;
+	struct dedup_stats stats;
+
+	// Everything below is under lock
+	pthread_mutex_t lock;
+	pthread_cond_t queued;	// for the writer: something to do
+	pthread_cond_t room;	// for putting: the queue has room
+	pthread_cond_t idle;	// for flushing: everything is committed
+
+	struct pending *head;
+	struct pending *tail;
+	int queuelen;
+
+	int intransaction;
+	int uncommitted;
+	int flushing;
+	int closing;
+
+	pthread_t writer;
+};
+
+static void fail(struct mbtiles *mb, const char *what) {
+	fprintf(stderr, "%s: %s: %s\n", mb->fname, what, sqlite3_errmsg(mb->db));
+	exit(EXIT_FAILURE);
+}
+
+static void exec(struct mbtiles *mb, const char *sql) {
+	char *err = NULL;
+
+	if (sqlite3_exec(mb->db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: %s\n", mb->fname, sql, err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int mbtiles_is(char *fname) {
+	size_t len = strlen(fname);
+	return len > 8 && strcmp(fname + len - 8, ".mbtiles") == 0;
+}
+
+// Find or add the image with the contents of the tile, and put its id
+// in id. Different images with the same hash and length are told apart
+// by a counter after them.
+static void store_image(struct mbtiles *mb, struct pending *p, char *id) {
+	int collision;
+
+	for (collision = 0; ; collision++) {
+		sprintf(id, "%016llx-%zu-%d", p->hash, p->len, collision);
+
+		sqlite3_bind_text(mb->lookup, 1, id, -1, SQLITE_STATIC);
+		int found = sqlite3_step(mb->lookup);
+
+		if (found == SQLITE_ROW) {
+			int same = sqlite3_column_bytes(mb->lookup, 0) == p->len &&
+				   memcmp(sqlite3_column_blob(mb->lookup, 0), p->data, p->len) == 0;
+			sqlite3_reset(mb->lookup);
+
+			if (same) {
+				mb->stats.saved += p->len;
+				return;
+			}
+			continue;
+		}
+
+		if (found != SQLITE_DONE) {
+			fail(mb, "lookup");
+		}
+		sqlite3_reset(mb->lookup);
+
+		sqlite3_bind_text(mb->image, 1, id, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(mb->image, 2, p->data, p->len, SQLITE_STATIC);
+		if (sqlite3_step(mb->image) != SQLITE_DONE) {
+			fail(mb, "insert image");
+		}
+		sqlite3_reset(mb->image);
+
+		mb->stats.distinct++;
+		return;
+	}
+}
+
+// Called with the lock held, and drops it while writing
+static void write_queue(struct mbtiles *mb) {
+	struct pending *p = mb->head;
+	mb->head = mb->tail = NULL;
+	mb->queuelen = 0;
+	pthread_cond_broadcast(&mb->room);
+
+	if (!mb->intransaction) {
+		exec(mb, "BEGIN IMMEDIATE");
+		mb->intransaction = 1;
+	}
+
+	pthread_mutex_unlock(&mb->lock);
+
+	int n = 0;
+	while (p != NULL) {
+		struct pending *next = p->next;
+
+		// MBTiles rows count up from the south, the opposite of tile y
+		sqlite3_bind_int(mb->insert, 1, p->z);
+		sqlite3_bind_int64(mb->insert, 2, p->x);
+		sqlite3_bind_int64(mb->insert, 3, (1LL << p->z) - 1 - p->y);
+
+		if (mb->dedup) {
+			char id[16 + 1 + 20 + 1 + 11 + 1];
+			store_image(mb, p, id);
+			sqlite3_bind_text(mb->insert, 4, id, -1, SQLITE_TRANSIENT);
+		} else {
+			sqlite3_bind_blob(mb->insert, 4, p->data, p->len, SQLITE_STATIC);
+		}
+
+		mb->stats.tiles++;
+		mb->stats.bytes += p->len;
+
+		if (sqlite3_step(mb->insert) != SQLITE_DONE) {
+			fail(mb, "insert");
+		}
+		sqlite3_reset(mb->insert);
+
+		free(p->data);
+		free(p);
+		p = next;
+		n++;
+	}
+
+	pthread_mutex_lock(&mb->lock);
+	mb->uncommitted += n;
+}
+
+static void commit(struct mbtiles *mb) {
+	exec(mb, "COMMIT");
+	mb->intransaction = 0;
+	mb->uncommitted = 0;
+}
+
+static void *run_writer(void *v) {
+	struct mbtiles *mb = v;
+
+	pthread_mutex_lock(&mb->lock);
+
+	while (1) {
+		if (mb->head != NULL) {
+			write_queue(mb);
+
+			if (mb->uncommitted >= BATCH) {
+				commit(mb);
+			}
+			continue;
+		}
+
+		if (mb->intransaction && (mb->flushing || mb->closing)) {
+			commit(mb);
+		}
+
+		if (!mb->intransaction) {
+			pthread_cond_broadcast(&mb->idle);
+
+			if (mb->closing) {
+				break;
+			}
+
+			pthread_cond_wait(&mb->queued, &mb->lock);
+		} else {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+
+			if (pthread_cond_timedwait(&mb->queued, &mb->lock, &ts) == ETIMEDOUT && mb->head == NULL) {
+				commit(mb);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&mb->lock);
+	return NULL;
+}
+
+// With dedup, or if the file was already made with it, identical
+// tiles are stored once, with a tiles view joining map to images
+struct mbtiles *mbtiles_open(char *fname, int dedup) {
+	struct mbtiles *mb = malloc(sizeof(struct mbtiles));
+	if (mb == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	mb->fname = fname;
+	if (sqlite3_open(fname, &mb->db) != SQLITE_OK) {
+		fail(mb, "open");
+	}
+
+	// Several renders may be writing into the same file at once
+	sqlite3_busy_timeout(mb->db, 60000);
+
+	exec(mb, "PRAGMA synchronous = OFF");
+	exec(mb, "CREATE TABLE IF NOT EXISTS metadata (name text, value text)");
+	exec(mb, "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name)");
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(mb->db, "SELECT type FROM sqlite_master WHERE name = 'tiles'", -1, &stmt, NULL) != SQLITE_OK) {
+		fail(mb, "prepare");
+	}
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *type = (const char *) sqlite3_column_text(stmt, 0);
+
+		if (strcmp(type, "view") == 0) {
+			dedup = 1;
+		} else if (dedup) {
+			fprintf(stderr, "%s: already has tiles that aren't deduplicated\n", fname);
+			exit(EXIT_FAILURE);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	mb->dedup = dedup;
+	mb->lookup = mb->image = NULL;
+	memset(&mb->stats, 0, sizeof(mb->stats));
+
+	if (dedup) {
+		exec(mb, "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id text)");
+		exec(mb, "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row)");
+		exec(mb, "CREATE TABLE IF NOT EXISTS images (tile_data blob, tile_id text)");
+		exec(mb, "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id)");
+		exec(mb, "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id");
+
+		if (sqlite3_prepare_v2(mb->db, "INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?)", -1, &mb->insert, NULL) != SQLITE_OK ||
+		    sqlite3_prepare_v2(mb->db, "SELECT tile_data FROM images WHERE tile_id = ?", -1, &mb->lookup, NULL) != SQLITE_OK ||
+		    sqlite3_prepare_v2(mb->db, "INSERT INTO images (tile_id, tile_data) VALUES (?, ?)", -1, &mb->image, NULL) != SQLITE_OK) {
+			fail(mb, "prepare");
+		}
+	} else {
+		exec(mb, "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob)");
+		exec(mb, "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row)");
+
+		if (sqlite3_prepare_v2(mb->db, "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)", -1, &mb->insert, NULL) != SQLITE_OK) {
+			fail(mb, "prepare");
+		}
+	}
+
+	pthread_mutex_init(&mb->lock, NULL);
+	pthread_cond_init(&mb->queued, NULL);
+	pthread_cond_init(&mb->room, NULL);
+	pthread_cond_init(&mb->idle, NULL);
+
+	mb->head = mb->tail = NULL;
+	mb->queuelen = 0;
+	mb->intransaction = 0;
+	mb->uncommitted = 0;
+	mb->flushing = 0;
+	mb->closing = 0;
+
+	if (pthread_create(&mb->writer, NULL, run_writer, mb) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+
+	return mb;
+}
+
+void mbtiles_put(struct mbtiles *mb, int z, unsigned int x, unsigned int y, void *data, size_t len) {
+	struct pending *p = malloc(sizeof(struct pending));
+	if (p == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	p->z = z;
+	p->x = x;
+	p->y = y;
+	p->data = data;
+	p->len = len;
+	p->hash = mb->dedup ? dedup_hash(data, len) : 0;
+	p->next = NULL;
+
+	pthread_mutex_lock(&mb->lock);
+
+	while (mb->queuelen >= QUEUE_MAX) {
+		pthread_cond_wait(&mb->room, &mb->lock);
+	}
+
+	if (mb->tail == NULL) {
+		mb->head = p;
+	} else {
+		mb->tail->next = p;
+	}
+	mb->tail = p;
+	mb->queuelen++;
+
+	pthread_cond_signal(&mb->queued);
+	pthread_mutex_unlock(&mb->lock);
+}
+
+// Wait for everything put so far to be committed, and return
+// with the lock held so the writer can't start again
+static void flush(struct mbtiles *mb) {
+	pthread_mutex_lock(&mb->lock);
+
+	mb->flushing++;
+	pthread_cond_signal(&mb->queued);
+
+	while (mb->head != NULL || mb->intransaction) {
+		pthread_cond_wait(&mb->idle, &mb->lock);
+	}
+
+	mb->flushing--;
+}
+
+void mbtiles_metadata(struct mbtiles *mb, char *name, char *value) {
+	flush(mb);
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(mb->db, "INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)", -1, &stmt, NULL) != SQLITE_OK) {
+		fail(mb, "prepare");
+	}
+
+	sqlite3_bind_text(stmt, 1, name, -1, SQLITE_TRANSIENT);
+	sqlite3_bind_text(stmt, 2, value, -1, SQLITE_TRANSIENT);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fail(mb, "metadata");
+	}
+	sqlite3_finalize(stmt);
+
+	pthread_mutex_unlock(&mb->lock);
+}
+
+// The range of zooms of the tiles in the file so far, which may
+// include ones from earlier runs. Returns 0 if there are none.
+int mbtiles_zooms(struct mbtiles *mb, int *minzoom, int *maxzoom) {
+	flush(mb);
+
+	sqlite3_stmt *stmt;
+	const char *sql = mb->dedup ? "SELECT min(zoom_level), max(zoom_level) FROM map" : "SELECT min(zoom_level), max(zoom_level) FROM tiles";
+	if (sqlite3_prepare_v2(mb->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		fail(mb, "prepare");
+	}
+
+	int found = 0;
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+		*minzoom = sqlite3_column_int(stmt, 0);
+		*maxzoom = sqlite3_column_int(stmt, 1);
+		found = 1;
+	}
+	sqlite3_finalize(stmt);
+
+	pthread_mutex_unlock(&mb->lock);
+	return found;
+}
+
+// How many tiles went in so far, and with dedup how much it saved
+void mbtiles_stats(struct mbtiles *mb, struct dedup_stats *st) {
+	flush(mb);
+	*st = mb->stats;
+	pthread_mutex_unlock(&mb->lock);
+}
+
+int mbtiles_dedup(struct mbtiles *mb) {
+	return mb->dedup;
+}
+
+void mbtiles_close(struct mbtiles *mb) {
+	pthread_mutex_lock(&mb->lock);
+	mb->closing = 1;
+	pthread_cond_signal(&mb->queued);
+	pthread_mutex_unlock(&mb->lock);
+
+	if (pthread_join(mb->writer, NULL) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+
+	sqlite3_finalize(mb->insert);
+	sqlite3_finalize(mb->lookup);
+	sqlite3_finalize(mb->image);
+	if (sqlite3_close(mb->db) != SQLITE_OK) {
+		fail(mb, "close");
+	}
+
+	pthread_mutex_destroy(&mb->lock);
+	pthread_cond_destroy(&mb->queued);
+	pthread_cond_destroy(&mb->room);
+	pthread_cond_destroy(&mb->idle);
+	free(mb);
+}
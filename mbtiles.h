@@ -0,0 +1,19 @@
+// Writing tiles into an MBTiles file, the SQLite database that tile
+// servers and mbutil use, instead of into a directory of small files.
+// All the writes go through one thread, which batches them into
+// transactions, so the tiles can come from any number of threads.
+
+struct mbtiles;
+
+int mbtiles_is(char *fname);
+struct mbtiles *mbtiles_open(char *fname, int dedup);
+
+// Takes over data, which must have come from malloc
+void mbtiles_put(struct mbtiles *mb, int z, unsigned int x, unsigned int y, void *data, size_t len);
+
+void mbtiles_metadata(struct mbtiles *mb, char *name, char *value);
+int mbtiles_zooms(struct mbtiles *mb, int *minzoom, int *maxzoom);
+int mbtiles_dedup(struct mbtiles *mb);
+struct dedup_stats;
+void mbtiles_stats(struct mbtiles *mb, struct dedup_stats *st);
+void mbtiles_close(struct mbtiles *mb);
@@ -4,22 +4,335 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "util.h"
 #include "graphics.h"
+#include "dataset.h"
+#include "summary.h"
+#include "occupancy.h"
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [-o outfile] [-u] file ...\n", argv[0]);
+	fprintf(stderr, "Usage: %s [-o outfile] [-u] [-cs] [-i zoom] [-P threads] file ...\n", argv[0]);
 	exit(EXIT_FAILURE);
 }
 
+// Records written out at once
+#define OUTBUF 65536
+
 struct file {
-	FILE *fp;
-	int remaining;
-	unsigned char *data;
+	struct level level;
+	long long cursor;
+	const unsigned char *data;
+	int which;	// of the inputs, to keep equal records in order
+};
+
+// One legs,level file to make from the inputs' files of the same name
+struct task {
+	int components;
+	int z_lookup;
+	long long cost;		// bytes in the inputs
+};
+
+struct merge {
+	struct dataset **inputs;
+	char **names;
+	int ninputs;
+	char *destdir;
+	int mapbits;
+	int metabits;
+	int uniq;
+	int flags;		// of the output, to see which inputs match it
+
+	struct task *tasks;
+	int ntasks;
+	int next;		// under lock
+	pthread_mutex_t lock;
 };
 
+// Advance to the next record of the file, if there is one
+static int nextrecord(struct file *f) {
+	if (f->cursor + 1 >= f->level.records) {
+		f->cursor = f->level.records;
+		return 0;
+	}
+
+	f->cursor++;
+	f->data = level_full_record(&f->level, f->cursor);
+	return 1;
+}
+
+static int before(struct file *a, struct file *b, int bytes) {
+	int c = memcmp(a->data, b->data, bytes);
+	return c < 0 || (c == 0 && a->which < b->which);
+}
+
+// Restore the heap below i after the record at i has changed
+static void sift(struct file **heap, int n, int i, int bytes) {
+	while (1) {
+		int least = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < n && before(heap[l], heap[least], bytes)) {
+			least = l;
+		}
+		if (r < n && before(heap[r], heap[least], bytes)) {
+			least = r;
+		}
+		if (least == i) {
+			return;
+		}
+
+		struct file *t = heap[i];
+		heap[i] = heap[least];
+		heap[least] = t;
+		i = least;
+	}
+}
+
+// Give dest the same contents as src: as a copy-on-write clone if the
+// filesystem can, or else as another link to the same file, or else
+// by copying it
+static void clone_file(char *src, char *dest) {
+#ifdef FICLONE
+	int in = open(src, O_RDONLY);
+	if (in < 0) {
+		perror(src);
+		exit(EXIT_FAILURE);
+	}
+
+	int out = open(dest, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (out < 0) {
+		perror(dest);
+		exit(EXIT_FAILURE);
+	}
+
+	int cloned = ioctl(out, FICLONE, in) == 0;
+	close(in);
+	close(out);
+
+	if (cloned) {
+		return;
+	}
+	unlink(dest);
+#endif
+
+	if (link(src, dest) == 0) {
+		return;
+	}
+
+	FILE *in_fp = fopen(src, "rb");
+	if (in_fp == NULL) {
+		perror(src);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *out_fp = fopen(dest, "wb");
+	if (out_fp == NULL) {
+		perror(dest);
+		exit(EXIT_FAILURE);
+	}
+
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in_fp)) > 0) {
+		if (fwrite(buf, 1, n, out_fp) != n) {
+			perror(dest);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (ferror(in_fp)) {
+		perror(src);
+		exit(EXIT_FAILURE);
+	}
+	fclose(in_fp);
+	if (fclose(out_fp) != 0) {
+		perror(dest);
+		exit(EXIT_FAILURE);
+	}
+}
+
+// If only one input has any records at this level and its files are
+// already the way the output wants them, clone them instead of merging.
+// Returns whether it did.
+static int clone_level(struct merge *m, struct file *files, int components, int z_lookup) {
+	int j, source = -1;
+
+	if (m->uniq) {
+		return 0;
+	}
+
+	for (j = 0; j < m->ninputs; j++) {
+		if (files[j].level.records > 0) {
+			if (source >= 0) {
+				return 0;
+			}
+			source = j;
+		}
+	}
+
+	if (source < 0 || m->inputs[source]->flags != m->flags || dataset_iscontainer(m->names[source])) {
+		return 0;
+	}
+
+	char *srcdir = m->names[source];
+	char src[strlen(srcdir) + 1 + 11 + 1 + 11 + 9];
+	char dest[strlen(m->destdir) + 1 + 11 + 1 + 11 + 9];
+	struct stat st;
+
+	// Without a summary to go with it, the level has to be merged
+	// so that one can be written. There is none without metadata.
+	sprintf(src, "%s/%d,%d.summary", srcdir, components, z_lookup);
+	if (m->metabits > 0 && stat(src, &st) != 0) {
+		return 0;
+	}
+
+	printf("cloning zoom level %d for point count %d from %s\n", z_lookup, components, srcdir);
+
+	char *suffixes[3];
+	int nsuffixes = 0;
+
+	suffixes[nsuffixes++] = "";
+	if (m->metabits > 0) {
+		suffixes[nsuffixes++] = ".summary";
+	}
+	if (m->flags & DATASET_SPLIT) {
+		suffixes[nsuffixes++] = ".meta";
+	}
+
+	for (j = 0; j < nsuffixes; j++) {
+		sprintf(src, "%s/%d,%d%s", srcdir, components, z_lookup, suffixes[j]);
+		sprintf(dest, "%s/%d,%d%s", m->destdir, components, z_lookup, suffixes[j]);
+		clone_file(src, dest);
+	}
+
+	return 1;
+}
+
+static void merge_level(struct merge *m, int components, int z_lookup) {
+	int bytes = bytesfor(m->mapbits, m->metabits, components, z_lookup);
+
+	struct file files[m->ninputs];
+	struct file *heap[m->ninputs];
+	int n = 0;
+	int j;
+
+	for (j = 0; j < m->ninputs; j++) {
+		if (!level_open(m->inputs[j], components, z_lookup, &files[j].level)) {
+			fprintf(stderr, "%s/%d,%d: No such file\n", m->names[j], components, z_lookup);
+			files[j].level.records = -1;
+			continue;
+		}
+
+		files[j].which = j;
+		if (files[j].level.records > 0) {
+			level_advise(&files[j].level, 0, files[j].level.records - 1, POSIX_MADV_SEQUENTIAL, 1);
+
+			files[j].cursor = 0;
+			files[j].data = level_full_record(&files[j].level, 0);
+			heap[n++] = &files[j];
+		}
+	}
+
+	if (n != 0 && !clone_level(m, files, components, z_lookup)) {
+		for (j = n / 2 - 1; j >= 0; j--) {
+			sift(heap, n, j, bytes);
+		}
+
+		printf("merging zoom level %d for point count %d (%d bytes)\n", z_lookup, components, bytes);
+
+		char outfname[strlen(m->destdir) + 1 + 5 + 1 + 5 + 1];
+		sprintf(outfname, "%s/%d,%d", m->destdir, components, z_lookup);
+		FILE *out = fopen(outfname, "wb");
+
+		if (out == NULL) {
+			perror(outfname);
+			exit(EXIT_FAILURE);
+		}
+
+		unsigned char *buf = malloc((size_t) OUTBUF * bytes);
+		if (buf == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		size_t used = 0;
+		unsigned char *wrote = NULL;	// the last record, for -u
+
+		while (n > 0) {
+			struct file *best = heap[0];
+
+			if (!m->uniq || wrote == NULL || memcmp(wrote, best->data, bytes) != 0) {
+				if (used == OUTBUF) {
+					if (fwrite(buf, bytes, used, out) != used) {
+						perror(outfname);
+						exit(EXIT_FAILURE);
+					}
+					used = 0;
+				}
+
+				wrote = buf + used * bytes;
+				memcpy(wrote, best->data, bytes);
+				used++;
+			}
+
+			if (!nextrecord(best)) {
+				heap[0] = heap[--n];
+			}
+			sift(heap, n, 0, bytes);
+		}
+
+		if (fwrite(buf, bytes, used, out) != used || fclose(out) != 0) {
+			perror(outfname);
+			exit(EXIT_FAILURE);
+		}
+		free(buf);
+
+		level_finish(outfname, m->mapbits, m->metabits, components, z_lookup, m->flags);
+	}
+
+	for (j = 0; j < m->ninputs; j++) {
+		if (files[j].level.records >= 0) {
+			level_close(&files[j].level);
+		}
+	}
+}
+
+// Each thread takes the biggest level that nobody has started yet
+static void *run_merge(void *v) {
+	struct merge *m = v;
+
+	while (1) {
+		pthread_mutex_lock(&m->lock);
+		int t = m->next++;
+		pthread_mutex_unlock(&m->lock);
+
+		if (t >= m->ntasks) {
+			return NULL;
+		}
+
+		merge_level(m, m->tasks[t].components, m->tasks[t].z_lookup);
+	}
+}
+
+static int taskcmp(const void *v1, const void *v2) {
+	const struct task *t1 = v1;
+	const struct task *t2 = v2;
+
+	if (t1->cost != t2->cost) {
+		return t1->cost < t2->cost ? 1 : -1;
+	}
+	if (t1->z_lookup != t2->z_lookup) {
+		return t1->z_lookup - t2->z_lookup;
+	}
+	return t1->components - t2->components;
+}
+
 int main(int argc, char **argv) {
 	int i;
 	extern int optind;
@@ -27,8 +340,12 @@ int main(int argc, char **argv) {
 
 	char *destdir = NULL;
 	int uniq = 0;
+	int compress = 0;
+	int split = 0;
+	int occzoom = -1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
 
-	while ((i = getopt(argc, argv, "o:u")) != -1) {
+	while ((i = getopt(argc, argv, "o:ucsi:P:")) != -1) {
 		switch (i) {
 		case 'o':
 			destdir = optarg;
@@ -38,6 +355,22 @@ int main(int argc, char **argv) {
 			uniq = 1;
 			break;
 
+		case 'c':
+			compress = 1;
+			break;
+
+		case 's':
+			split = 1;
+			break;
+
+		case 'i':
+			occzoom = atoi(optarg);
+			break;
+
+		case 'P':
+			threads = atoi(optarg);
+			break;
+
 		default:
 			usage(argv);
 		}
@@ -53,29 +386,14 @@ int main(int argc, char **argv) {
 	int mapbits = 0;
 	int metabits = 0;
 
-	for (i = 0; i < nfile; i++) {
-		char *fname = argv[optind + i];
-
-		char meta[strlen(fname) + 1 + 4 + 1];
-		sprintf(meta, "%s/meta", fname);
-		FILE *f = fopen(meta, "r");
-		if (f == NULL) {
-			perror(meta);
-			exit(EXIT_FAILURE);
-		}
+	struct dataset *inputs[nfile];
 
-		int file_mapbits, file_metabits, file_maxn;
+	for (i = 0; i < nfile; i++) {
+		inputs[i] = dataset_open(argv[optind + i]);
 
-		char s[2000] = "";
-		if (fgets(s, 2000, f) == NULL || strcmp(s, "1\n") != 0) {
-			fprintf(stderr, "%s: Unknown version %s", meta, s);
-			exit(EXIT_FAILURE);
-		}
-		if (fgets(s, 2000, f) == NULL || sscanf(s, "%d %d %d", &file_mapbits, &file_metabits, &file_maxn) != 3) {
-			fprintf(stderr, "%s: couldn't find size declaration", meta);
-			exit(EXIT_FAILURE);
-		}
-		fclose(f);
+		int file_mapbits = inputs[i]->mapbits;
+		int file_metabits = inputs[i]->metabits;
+		int file_maxn = inputs[i]->maxn;
 
 		if (i > 0) {
 			if (file_mapbits != mapbits || file_metabits != metabits) {
@@ -101,108 +419,90 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	char s[strlen(destdir) + 5 + 1];
-	sprintf(s, "%s/meta", destdir);
-	FILE *f = fopen(s, "w");
-	if (f == NULL) {
-		perror(s);
+	// Without any metadata there is nothing to split off
+	if (metabits == 0) {
+		split = 0;
+	}
+
+	int flags = (compress ? DATASET_COMPRESSED : 0) | (split ? DATASET_SPLIT : 0);
+	dataset_write_meta(destdir, mapbits, metabits, maxn, flags);
+
+	struct merge m;
+	m.inputs = inputs;
+	m.names = argv + optind;
+	m.ninputs = nfile;
+	m.destdir = destdir;
+	m.mapbits = mapbits;
+	m.metabits = metabits;
+	m.uniq = uniq;
+	m.flags = flags;
+
+	// Lines whose points all share every bit of their
+	// coordinates are at level mapbits / 2 = maxzoom + 8
+
+	m.tasks = malloc((maxzoom + 9) * maxn * sizeof(struct task));
+	if (m.tasks == NULL) {
+		perror("malloc");
 		exit(EXIT_FAILURE);
 	}
-	fprintf(f, "1\n");
-	fprintf(f, "%d %d %d\n", mapbits, metabits, maxn);
-	fclose(f);
+	m.ntasks = 0;
 
 	int z_lookup;
-	for (z_lookup = 0; z_lookup < maxzoom + 8; z_lookup++) {
+	for (z_lookup = 0; z_lookup <= maxzoom + 8; z_lookup++) {
 		for (i = 1; i <= maxn; i++) {
 			if (i == 1 && z_lookup != 0) {
 				continue;
 			}
 
-			int bytes = bytesfor(mapbits, metabits, i, z_lookup);
-			printf("merging zoom level %d for point count %d (%d bytes)\n", z_lookup, i, bytes);
-
-			struct file files[nfile];
-			int n = 0;
-			int remaining = 0;
+			struct task *t = &m.tasks[m.ntasks++];
+			t->components = i;
+			t->z_lookup = z_lookup;
+			t->cost = 0;
 
 			int j;
 			for (j = 0; j < nfile; j++) {
-				char *fname = argv[optind + j];
-
-				char fname2[strlen(fname) + 1 + 5 + 1 + 5 + 1];
-				sprintf(fname2, "%s/%d,%d", fname, i, z_lookup);
-
-				files[n].fp = fopen(fname2, "rb");
-				if (files[n].fp == NULL) {
-					perror(fname2);
-				} else {
-					files[n].data = malloc(bytes);
-					files[n].remaining = fread(files[n].data, bytes, 1, files[n].fp);
-					if (files[n].remaining > 0) {
-						remaining++;
-					}
-					n++;
-				}
-			}
-
-			if (remaining != 0) {
-				char outfname[strlen(destdir) + 1 + 5 + 1 + 5 + 1];
-				sprintf(outfname, "%s/%d,%d", destdir, i, z_lookup);
-				FILE *out = fopen(outfname, "wb");
+				char fname[strlen(argv[optind + j]) + 1 + 5 + 1 + 5 + 1];
+				struct stat st;
 
-				if (out == NULL) {
-					perror(outfname);
-					exit(EXIT_FAILURE);
+				sprintf(fname, "%s/%d,%d", argv[optind + j], i, z_lookup);
+				if (stat(fname, &st) == 0) {
+					t->cost += st.st_size;
 				}
+			}
+		}
+	}
 
-				unsigned char wrote[bytes];
-				memset(wrote, 0, bytes);
-
-				while (remaining) {
-					int best = -1;
-
-					for (j = 0; j < n; j++) {
-						if (files[j].remaining) {
-							if (best < 0 || memcmp(files[j].data, files[best].data, bytes) < 0) {
-								best = j;
-							}
-						}
-					}
-
-					if (best < 0) {
-						fprintf(stderr, "shouldn't happen\n");
-						break;
-					}
-
-					int skip = 0;
-					if (uniq) {
-						if (memcmp(wrote, files[best].data, bytes) == 0) {
-							skip = 1;
-						}
+	// The levels are independent of each other, so they are merged
+	// at the same time, biggest first so that none is left for last
 
-						memcpy(wrote, files[best].data, bytes);
-					}
+	qsort(m.tasks, m.ntasks, sizeof(struct task), taskcmp);
+	m.next = 0;
+	pthread_mutex_init(&m.lock, NULL);
 
-					if (!skip) {
-						fwrite(files[best].data, bytes, 1, out);
-					}
+	if (threads < 1) {
+		threads = 1;
+	}
+	pthread_t workers[threads];
 
-					files[best].remaining = fread(files[best].data, bytes, 1, files[best].fp);
-					if (files[best].remaining <= 0) {
-						remaining--;
-					}
-				}
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i], NULL, run_merge, &m) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < threads; i++) {
+		if (pthread_join(workers[i], NULL) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-				fclose(out);
-			}
+	free(m.tasks);
 
-			for (j = 0; j < n; j++) {
-				free(files[j].data);
-				fclose(files[j].fp);
-			}
-		}
+	if (occzoom < 0) {
+		occzoom = maxzoom;
 	}
+	occupancy_write(destdir, occzoom);
 
 	return 0;
 }
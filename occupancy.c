@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "dataset.h"
+#include "occupancy.h"
+
+// File layout: the 8-byte magic number, the zoom level and the number of
+// tiles as 64-bit numbers, and then the quadkey at that zoom and the
+// number of records for each tile that has any, in quadkey order, all
+// in native byte order.
+
+static const char magic[8] = "dmocc01\n";
+
+static int entrycmp(const void *v1, const void *v2) {
+	const unsigned long long *e1 = v1;
+	const unsigned long long *e2 = v2;
+
+	if (e1[0] < e2[0]) {
+		return -1;
+	} else if (e1[0] > e2[0]) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+// The quadkey at the zoom of the first point of the record
+static unsigned long long record_key(const unsigned char *rec, int bytes, int zoom) {
+	unsigned long long key = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		key = (key << 8) | (i < bytes ? rec[i] : 0);
+	}
+
+	if (zoom == 0) {
+		return 0;
+	}
+	return key >> (64 - 2 * zoom);
+}
+
+// The quadkey at the zoom and the number of records for each tile of the
+// dataset that has any, in quadkey order, as pairs in a malloced array
+unsigned long long *occupancy_build(struct dataset *ds, int zoom, long long *ntiles) {
+	long long n = 0;
+	long long nalloc = 1024;
+	unsigned long long *entries = malloc(2 * nalloc * sizeof(unsigned long long));
+	if (entries == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	// Each level file is in order, so its records for each tile are
+	// together. The runs from the different files are combined after.
+
+	int z_lookup;
+	for (z_lookup = 0; z_lookup <= ds->mapbits / 2; z_lookup++) {
+		int components;
+
+		for (components = 1; components <= ds->maxn; components++) {
+			if (components == 1 && z_lookup != 0) {
+				continue;
+			}
+
+			struct level lv;
+			if (!level_open(ds, components, z_lookup, &lv)) {
+				continue;
+			}
+
+			long long i;
+			for (i = 0; i < lv.records; i++) {
+				unsigned long long key = record_key(level_record(&lv, i), lv.bytes, zoom);
+
+				if (i > 0 && entries[2 * (n - 1)] == key) {
+					entries[2 * (n - 1) + 1]++;
+					continue;
+				}
+
+				if (n >= nalloc) {
+					nalloc *= 2;
+					entries = realloc(entries, 2 * nalloc * sizeof(unsigned long long));
+					if (entries == NULL) {
+						perror("realloc");
+						exit(EXIT_FAILURE);
+					}
+				}
+
+				entries[2 * n] = key;
+				entries[2 * n + 1] = 1;
+				n++;
+			}
+
+			level_close(&lv);
+		}
+	}
+
+	qsort(entries, n, 2 * sizeof(unsigned long long), entrycmp);
+
+	long long tiles = 0;
+	long long i;
+	for (i = 0; i < n; i++) {
+		if (tiles > 0 && entries[2 * (tiles - 1)] == entries[2 * i]) {
+			entries[2 * (tiles - 1) + 1] += entries[2 * i + 1];
+		} else {
+			entries[2 * tiles] = entries[2 * i];
+			entries[2 * tiles + 1] = entries[2 * i + 1];
+			tiles++;
+		}
+	}
+
+	*ntiles = tiles;
+	return entries;
+}
+
+// Write the occupancy for the dataset directory dir, whose meta
+// and level files must already be complete
+void occupancy_write(char *dir, int zoom) {
+	struct dataset *ds = dataset_open(dir);
+
+	if (zoom > ds->mapbits / 2) {
+		zoom = ds->mapbits / 2;
+	}
+	if (zoom < 0) {
+		zoom = 0;
+	}
+
+	long long tiles;
+	unsigned long long *entries = occupancy_build(ds, zoom, &tiles);
+
+	char fname[strlen(dir) + 1 + 9 + 1];
+	sprintf(fname, "%s/occupancy", dir);
+
+	FILE *f = fopen(fname, "wb");
+	if (f == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	long long header[2] = { zoom, tiles };
+	fwrite(magic, sizeof(magic), 1, f);
+	fwrite(header, sizeof(header), 1, f);
+	if (tiles > 0 && fwrite(entries, 2 * sizeof(unsigned long long), tiles, f) != tiles) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	if (fclose(f) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	free(entries);
+	dataset_close(ds);
+}
+
+// Returns NULL if the dataset doesn't have an occupancy
+struct occupancy *occupancy_open(struct dataset *ds) {
+	struct occupancy *o = malloc(sizeof(struct occupancy));
+	if (o == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!dataset_map(ds, "occupancy", &o->map)) {
+		free(o);
+		return NULL;
+	}
+
+	if (o->map.len < 24 || memcmp(o->map.data, magic, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s/occupancy: not an occupancy; ignoring it\n", ds->name);
+		occupancy_close(o);
+		return NULL;
+	}
+
+	const long long *header = (const long long *) (o->map.data + 8);
+	o->zoom = header[0];
+	o->tiles = header[1];
+	o->entries = (const unsigned long long *) (o->map.data + 24);
+
+	if (o->zoom < 0 || o->zoom > ds->mapbits / 2 || o->tiles < 0 || 24 + o->tiles * 16 != o->map.len) {
+		fprintf(stderr, "%s/occupancy: truncated or doesn't match; ignoring it\n", ds->name);
+		occupancy_close(o);
+		return NULL;
+	}
+
+	return o;
+}
+
+// The first entry with a quadkey no less than key
+static long long lower_bound(struct occupancy *o, unsigned long long key) {
+	long long lo = 0, hi = o->tiles;
+
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+
+		if (o->entries[2 * mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// How many records have their first point in the tile, which must
+// be at the zoom of the occupancy or lower. 0 means the tile is empty.
+long long occupancy_count(struct occupancy *o, int z, unsigned int x, unsigned int y) {
+	if (z > o->zoom) {
+		return -1;
+	}
+
+	int shift = 2 * (o->zoom - z);
+	unsigned long long start = 0;
+	unsigned long long last = ~0ULL;
+	if (shift < 64) {
+		start = zxy2key(z, x, y) << shift;
+		last = start + ((1ULL << shift) - 1);
+	}
+
+	long long i = lower_bound(o, start);
+	long long count = 0;
+
+	for (; i < o->tiles && o->entries[2 * i] <= last; i++) {
+		count += o->entries[2 * i + 1];
+	}
+
+	return count;
+}
+
+void occupancy_close(struct occupancy *o) {
+	dataset_unmap(&o->map);
+	free(o);
+}
@@ -0,0 +1,18 @@
+// Which tiles have data in them, kept beside a dataset's level files as
+// "occupancy", so that listing the tiles doesn't have to read the data.
+// It has the number of records whose first point is in each tile of
+// one zoom level; the counts for lower zooms are sums of those.
+
+struct occupancy {
+	int zoom;
+	long long tiles;
+	const unsigned long long *entries;	// quadkey and count for each tile
+
+	struct mapping map;
+};
+
+unsigned long long *occupancy_build(struct dataset *ds, int zoom, long long *ntiles);
+void occupancy_write(char *dir, int zoom);
+struct occupancy *occupancy_open(struct dataset *ds);
+long long occupancy_count(struct occupancy *o, int z, unsigned int x, unsigned int y);
+void occupancy_close(struct occupancy *o);
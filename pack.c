@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <dirent.h>
+#include "util.h"
+#include "dataset.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s -o container dir\n", argv[0]);
+	fprintf(stderr, "Usage: %s -u -o dir container\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+static int namecmp(const void *v1, const void *v2) {
+	return strcmp(((const struct section *) v1)->name, ((const struct section *) v2)->name);
+}
+
+// Is this the name of one of the level files of a dataset, or of one
+// of the summaries, metadata columns, or occupancy that go with them?
+// If it is one of the others, *summary is set.
+static int isdatafile(const char *name, int *legs, int *level, int *summary) {
+	char check[sizeof(((struct section *) 0)->name)];
+
+	if (strcmp(name, "occupancy") == 0) {
+		*summary = 1;
+		return 1;
+	}
+
+	if (sscanf(name, "%d,%d", legs, level) != 2) {
+		return 0;
+	}
+
+	sprintf(check, "%d,%d", *legs, *level);
+	if (strcmp(name, check) == 0) {
+		*summary = 0;
+		return 1;
+	}
+
+	sprintf(check, "%d,%d.summary", *legs, *level);
+	if (strcmp(name, check) == 0) {
+		*summary = 1;
+		return 1;
+	}
+
+	sprintf(check, "%d,%d.meta", *legs, *level);
+	if (strcmp(name, check) == 0) {
+		*summary = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void copyout(FILE *out, const unsigned char *data, long long len, char *name) {
+	if (len > 0 && fwrite(data, len, 1, out) != 1) {
+		perror(name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void pad(FILE *out, long long to, char *name) {
+	long long here = ftell(out);
+
+	while (here < to) {
+		if (putc('\0', out) == EOF) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+		here++;
+	}
+}
+
+static void pack(char *dir, char *outfile) {
+	struct dataset *ds = dataset_open(dir);
+
+	DIR *d = opendir(dir);
+	if (d == NULL) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	int nsections = 0;
+	int nalloc = 100;
+	struct section *sections = malloc(nalloc * sizeof(struct section));
+	if (sections == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		int legs, level, summary;
+
+		if (!isdatafile(de->d_name, &legs, &level, &summary)) {
+			continue;
+		}
+
+		// Each level gets a block index too, unless it is compressed
+		// and so has one of its own
+		if (nsections + 2 > nalloc) {
+			nalloc *= 2;
+			sections = realloc(sections, nalloc * sizeof(struct section));
+			if (sections == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		memset(&sections[nsections], '\0', sizeof(struct section));
+		strcpy(sections[nsections].name, de->d_name);
+		nsections++;
+
+		if (!summary && !(ds->flags & DATASET_COMPRESSED)) {
+			memset(&sections[nsections], '\0', sizeof(struct section));
+			sprintf(sections[nsections].name, "%d,%d.index", legs, level);
+			nsections++;
+		}
+	}
+	closedir(d);
+
+	// Each index sorts right after its level file
+
+	qsort(sections, nsections, sizeof(struct section), namecmp);
+
+	// Now that they are in order, map the files and lay out the sections.
+	// widths[] is the record size for each index, and 0 for other sections.
+
+	struct mapping maps[nsections];
+	int widths[nsections];
+
+	long long page = sysconf(_SC_PAGESIZE);
+	long long offset = sizeof(struct container_header) + nsections * sizeof(struct section);
+
+	int i;
+	for (i = 0; i < nsections; i++) {
+		int legs, level;
+
+		if (strstr(sections[i].name, ".index") != NULL) {
+			// The index goes with the level file just before it
+			sscanf(sections[i].name, "%d,%d", &legs, &level);
+			widths[i] = dataset_bytes(ds, legs, level);
+
+			long long records = INDEX_BLOCK / widths[i];
+			if (records < 1) {
+				records = 1;
+			}
+
+			long long n = maps[i - 1].len / widths[i];
+			sections[i].length = 8 + (n + records - 1) / records * widths[i];
+			maps[i].data = NULL;
+			maps[i].map = NULL;
+		} else {
+			if (!dataset_map(ds, sections[i].name, &maps[i])) {
+				fprintf(stderr, "%s/%s: disappeared\n", dir, sections[i].name);
+				exit(EXIT_FAILURE);
+			}
+
+			sections[i].length = maps[i].len;
+			widths[i] = 0;
+		}
+
+		offset = (offset + page - 1) / page * page;
+		sections[i].offset = offset;
+		offset += sections[i].length;
+	}
+
+	FILE *out = fopen(outfile, "wb");
+	if (out == NULL) {
+		perror(outfile);
+		exit(EXIT_FAILURE);
+	}
+
+	struct container_header h;
+	memset(&h, '\0', sizeof(h));
+	memcpy(h.magic, CONTAINER_MAGIC, sizeof(h.magic));
+	h.version = ds->flags == 0 ? 1 : 2;
+	h.mapbits = ds->mapbits;
+	h.metabits = ds->metabits;
+	h.maxn = ds->maxn;
+	h.nsections = nsections;
+	h.flags = ds->flags;
+
+	copyout(out, (unsigned char *) &h, sizeof(h), outfile);
+	copyout(out, (unsigned char *) sections, nsections * sizeof(struct section), outfile);
+
+	for (i = 0; i < nsections; i++) {
+		pad(out, sections[i].offset, outfile);
+
+		if (widths[i] != 0) {
+			int bytes = widths[i];
+			long long records = INDEX_BLOCK / bytes;
+			if (records < 1) {
+				records = 1;
+			}
+
+			copyout(out, (unsigned char *) &records, sizeof(records), outfile);
+
+			long long n = maps[i - 1].len / bytes;
+			long long j;
+			for (j = 0; j < n; j += records) {
+				copyout(out, maps[i - 1].data + j * bytes, bytes, outfile);
+			}
+
+			dataset_unmap(&maps[i - 1]);
+		} else {
+			copyout(out, maps[i].data, maps[i].len, outfile);
+
+			if (i + 1 >= nsections || widths[i + 1] == 0) {
+				dataset_unmap(&maps[i]);
+			}
+		}
+	}
+
+	if (fclose(out) != 0) {
+		perror(outfile);
+		exit(EXIT_FAILURE);
+	}
+
+	free(sections);
+	dataset_close(ds);
+}
+
+static void unpack(char *container, char *dir) {
+	struct dataset *ds = dataset_open(container);
+
+	if (ds->map == NULL) {
+		fprintf(stderr, "%s: Not a datamaps container\n", container);
+		exit(EXIT_FAILURE);
+	}
+
+	if (mkdir(dir, 0777) != 0) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	dataset_write_meta(dir, ds->mapbits, ds->metabits, ds->maxn, ds->flags);
+
+	char fn[strlen(dir) + 1 + sizeof(((struct section *) 0)->name) + 1];
+
+	int i;
+	for (i = 0; i < ds->nsections; i++) {
+		char name[sizeof(ds->sections[i].name) + 1];
+		int legs, level, summary;
+
+		memcpy(name, ds->sections[i].name, sizeof(ds->sections[i].name));
+		name[sizeof(ds->sections[i].name)] = '\0';
+
+		// The block indexes are only for containers
+		if (!isdatafile(name, &legs, &level, &summary)) {
+			continue;
+		}
+
+		sprintf(fn, "%s/%s", dir, name);
+		FILE *f = fopen(fn, "wb");
+		if (f == NULL) {
+			perror(fn);
+			exit(EXIT_FAILURE);
+		}
+
+		copyout(f, ds->map + ds->sections[i].offset, ds->sections[i].length, fn);
+
+		if (fclose(f) != 0) {
+			perror(fn);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	dataset_close(ds);
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	char *outfile = NULL;
+	int reverse = 0;
+
+	while ((i = getopt(argc, argv, "o:u")) != -1) {
+		switch (i) {
+		case 'o':
+			outfile = optarg;
+			break;
+
+		case 'u':
+			reverse = 1;
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (argc - optind != 1 || outfile == NULL) {
+		usage(argv);
+	}
+
+	if (reverse) {
+		unpack(argv[optind], outfile);
+	} else {
+		pack(argv[optind], outfile);
+	}
+
+	return 0;
+}
@@ -21,7 +21,32 @@ struct graphics *graphics_init(int width, int height, char **filetype) {
 	return g;
 }
 
-void out(struct graphics *gc, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie) {
+// Text goes straight to stdout, so it can only be drawn serially
+struct graphics *graphics_plane(struct graphics *gc) {
+	return NULL;
+}
+
+void graphics_merge(struct graphics *gc, struct graphics *plane) {
+}
+
+// Text has already gone to stdout, so there is nothing to cut up
+struct graphics *graphics_crop(struct graphics *gc, int x, int y, int width, int height) {
+	return NULL;
+}
+
+int graphics_blank(struct graphics *gc) {
+	return 0;
+}
+
+int graphics_wants_meta(struct graphics *gc) {
+	return 0;
+}
+
+void graphics_free(struct graphics *gc) {
+	free(gc);
+}
+
+void out(struct graphics *gc, FILE *fp, int transparency, double gamma, int invert, int bg, int color, int color2, int saturate, int mask, double color_cap, int cie) {
 }
 
 // http://rosettacode.org/wiki/Bitmap/Bresenham's_line_algorithm#C
@@ -99,6 +124,46 @@ void drawBrush(double x, double y, struct graphics *g, double bright, double bru
 	drawPixel(x, y, g, bright, hue, meta, tc);
 }
 
+// Every pixel whose center is within the disk, so that the disk covers
+// the same area as it does in a PNG
+void drawDisk(double x, double y, struct graphics *g, double bright, double radius, double hue, long long meta, struct tilecontext *tc) {
+	// Only the part within the tile
+	double xmin = tc->xoff, ymin = tc->yoff;
+	double xmax = tc->xoff + g->width, ymax = tc->yoff + g->height;
+
+	int x0 = floor(x - radius), x1 = ceil(x + radius);
+	int y0 = floor(y - radius), y1 = ceil(y + radius);
+	if (x0 < xmin) {
+		x0 = xmin;
+	}
+	if (x1 > xmax) {
+		x1 = xmax;
+	}
+	if (y0 < ymin) {
+		y0 = ymin;
+	}
+	if (y1 > ymax) {
+		y1 = ymax;
+	}
+
+	int xx, yy, drawn = 0;
+	for (yy = y0; yy < y1; yy++) {
+		for (xx = x0; xx < x1; xx++) {
+			double dx = xx + .5 - x, dy = yy + .5 - y;
+
+			if (dx * dx + dy * dy < radius * radius) {
+				drawPixel(xx, yy, g, bright, hue, meta, tc);
+				drawn = 1;
+			}
+		}
+	}
+
+	// A disk too small to cover any pixel's center is still there
+	if (!drawn && x >= xmin && x < xmax && y >= ymin && y < ymax) {
+		drawPixel(x - .5, y - .5, g, bright, hue, meta, tc);
+	}
+}
+
 void setClip(struct graphics *gc, int x, int y, int w, int h) {
 
 }
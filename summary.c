@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "dataset.h"
+#include "summary.h"
+
+// File layout: the 8-byte magic number, the number of records per
+// block as a 64-bit number, and then a 64-bit min and max for each
+// block, all in native byte order.
+
+static const char magic[8] = "dmsum01\n";
+
+// Write the summary for the level file fname, which must already be sorted
+void summary_write(char *fname, int mapbits, int metabits, int components, int z_lookup) {
+	char sname[strlen(fname) + 8 + 1];
+	sprintf(sname, "%s.summary", fname);
+
+	if (metabits == 0) {
+		unlink(sname);
+		return;
+	}
+
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror("stat");
+		exit(EXIT_FAILURE);
+	}
+
+	FILE *f = fopen(sname, "wb");
+	if (f == NULL) {
+		perror(sname);
+		exit(EXIT_FAILURE);
+	}
+
+	int bytes = bytesfor(mapbits, metabits, components, z_lookup);
+	long long records = SUMMARY_BLOCK / bytes;
+	if (records < 1) {
+		records = 1;
+	}
+
+	fwrite(magic, sizeof(magic), 1, f);
+	fwrite(&records, sizeof(records), 1, f);
+
+	if (st.st_size > 0) {
+		unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+
+		long long n = st.st_size / bytes;
+		long long i;
+
+		for (i = 0; i < n; i += records) {
+			unsigned long long minmax[2] = { ~0ULL, 0 };
+			long long j;
+
+			for (j = i; j < i + records && j < n; j++) {
+				unsigned int x[components], y[components];
+				unsigned long long meta = 0;
+
+				buf2xys(map + j * bytes, mapbits, metabits, z_lookup, components, x, y, &meta);
+
+				if (meta < minmax[0]) {
+					minmax[0] = meta;
+				}
+				if (meta > minmax[1]) {
+					minmax[1] = meta;
+				}
+			}
+
+			fwrite(minmax, sizeof(minmax), 1, f);
+		}
+
+		munmap(map, st.st_size);
+	}
+
+	if (fclose(f) != 0) {
+		perror(sname);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+// Open the summary for the level file of the dataset, which has the specified
+// number of records. Returns NULL if there isn't one or it doesn't match the file.
+struct summary *summary_open(struct dataset *ds, char *file, long long records) {
+	char sname[strlen(file) + 8 + 1];
+	sprintf(sname, "%s.summary", file);
+
+	struct summary *s = malloc(sizeof(struct summary));
+	if (s == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!dataset_map(ds, sname, &s->map)) {
+		free(s);
+		return NULL;
+	}
+
+	if (s->map.len < 16 || memcmp(s->map.data, magic, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s/%s: not a summary; ignoring it\n", ds->name, sname);
+		summary_close(s);
+		return NULL;
+	}
+
+	s->records = ((const long long *) s->map.data)[1];
+	s->minmax = (const unsigned long long *) (s->map.data + 16);
+	s->blocks = (s->map.len - 16) / (2 * sizeof(unsigned long long));
+
+	if (s->records < 1 || s->blocks != (records + s->records - 1) / s->records) {
+		fprintf(stderr, "%s/%s: doesn't match %s; ignoring it\n", ds->name, sname, file);
+		summary_close(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+// Could any of the records in the block have metadata from min to max?
+int summary_overlaps(struct summary *s, long long block, unsigned long long min, unsigned long long max) {
+	if (block < 0 || block >= s->blocks) {
+		return 1;
+	}
+
+	return s->minmax[2 * block] <= max && s->minmax[2 * block + 1] >= min;
+}
+
+void summary_close(struct summary *s) {
+	dataset_unmap(&s->map);
+	free(s);
+}
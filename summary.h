@@ -0,0 +1,18 @@
+// The smallest and largest metadata in each block of records of a level
+// file, kept beside it as legs,level.summary, so that readers filtering
+// by metadata can skip the blocks that are entirely outside their range.
+
+#define SUMMARY_BLOCK 4096 // bytes of records in each block, roughly
+
+struct summary {
+	long long records;			// per block
+	long long blocks;
+	const unsigned long long *minmax;	// min and max for each block
+
+	struct mapping map;
+};
+
+void summary_write(char *fname, int mapbits, int metabits, int components, int z_lookup);
+struct summary *summary_open(struct dataset *ds, char *file, long long records);
+int summary_overlaps(struct summary *s, long long block, unsigned long long min, unsigned long long max);
+void summary_close(struct summary *s);
@@ -0,0 +1,729 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+#include "util.h"
+#include "graphics.h"
+#include "dataset.h"
+#include "occupancy.h"
+#include "writer.h"
+#include "dedup.h"
+#include "draw.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-t transparency] [-agmsw] [-C colors] [-b bgcolor] [-c color1] [-S color2] [-B zoom:level:ramp] [-G gamma] [-O offset] [-M latitude] [-l lineramp] [-z max] [-Z min] [-R minlat,minlon,maxlat,maxlon] [-k metatile] [-P threads] [-u tilelist] [-H] -o dir|file.mbtiles file [-f file ...]\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+// A block of metatile x metatile tiles, drawn together, whose
+// top left tile is x, y. The cost is the number of records whose
+// first point is in it, plus a fixed cost for encoding its tiles.
+
+struct job {
+	int z;
+	unsigned int x;
+	unsigned int y;
+	int metatile;
+	long long cost;
+	unsigned long long order;
+};
+
+#define TILE_COST 1000
+
+static int tilecmp(const void *v1, const void *v2) {
+	const unsigned long long *t1 = v1;
+	const unsigned long long *t2 = v2;
+
+	if (t1[0] < t2[0]) {
+		return -1;
+	} else if (t1[0] > t2[0]) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+// Jobs are in quadkey order, so a block comes right before the blocks
+// at higher zooms that are within it, and neighboring blocks read
+// neighboring parts of the level files.
+static int jobcmp(const void *v1, const void *v2) {
+	const struct job *j1 = v1;
+	const struct job *j2 = v2;
+
+	if (j1->order < j2->order) {
+		return -1;
+	} else if (j1->order > j2->order) {
+		return 1;
+	}
+
+	return j1->z - j2->z;
+}
+
+// The jobs from start to end are still to be done by a worker, which
+// takes them from the front. When another worker runs out, it takes
+// the back half of whichever worker has the most cost left.
+
+struct deque {
+	long long start;
+	long long end;
+	long long cost;
+	pthread_mutex_t lock;
+};
+
+struct worker {
+	int id;
+	pthread_t thread;
+	struct work *work;
+
+	long long jobs;
+	long long steals;
+	long long written;
+	long long blank;
+	long long bytes;
+};
+
+struct work {
+	struct job *jobs;
+	long long njobs;
+	struct deque *deques;
+	int threads;
+
+	struct file *files;
+	int nfiles;
+	struct writer *writer;
+
+	long long done;
+	int progress;
+	pthread_mutex_t lock;
+};
+
+static int take(struct deque *d, struct job *jobs, long long *j) {
+	int got = 0;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->start < d->end) {
+		*j = d->start++;
+		d->cost -= jobs[*j].cost;
+		got = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return got;
+}
+
+static int steal(struct work *w, int id) {
+	while (1) {
+		int victim = -1;
+		long long most = 0;
+		int i;
+
+		for (i = 0; i < w->threads; i++) {
+			if (i == id) {
+				continue;
+			}
+
+			pthread_mutex_lock(&w->deques[i].lock);
+			if (w->deques[i].start < w->deques[i].end && w->deques[i].cost > most) {
+				most = w->deques[i].cost;
+				victim = i;
+			}
+			pthread_mutex_unlock(&w->deques[i].lock);
+		}
+
+		if (victim < 0) {
+			return 0;
+		}
+
+		struct deque *d = &w->deques[victim];
+		long long start = 0, end = 0, cost = 0;
+
+		pthread_mutex_lock(&d->lock);
+		if (d->start < d->end) {
+			// The back half by cost, but always at least one job
+			long long half = d->cost / 2;
+			end = d->end;
+			start = d->end - 1;
+			cost = w->jobs[start].cost;
+
+			while (start > d->start && cost + w->jobs[start - 1].cost <= half) {
+				start--;
+				cost += w->jobs[start].cost;
+			}
+
+			d->end = start;
+			d->cost -= cost;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		// Someone else got there first; look again
+		if (start == end) {
+			continue;
+		}
+
+		struct deque *mine = &w->deques[id];
+		pthread_mutex_lock(&mine->lock);
+		mine->start = start;
+		mine->end = end;
+		mine->cost = cost;
+		pthread_mutex_unlock(&mine->lock);
+
+		return 1;
+	}
+}
+
+static void write_tile(struct worker *wk, struct graphics *tile, int z, unsigned int x, unsigned int y, char *filetype) {
+	size_t len;
+	char *buf = out_buffer(tile, &len);
+
+	writer_put(wk->work->writer, z, x, y, filetype, buf, len);
+	wk->bytes += len;
+}
+
+static void run_job(struct worker *wk, struct job *j) {
+	struct work *w = wk->work;
+	char *filetype;
+
+	struct graphics *gc = graphics_init(tilesize * j->metatile, tilesize * j->metatile, &filetype);
+	draw_files(gc, w->files, w->nfiles, &colors, j->z, j->x, j->y, gps, 0, 0, 0, j->metatile);
+
+	if (j->metatile == 1) {
+		if (graphics_blank(gc)) {
+			wk->blank++;
+		} else {
+			write_tile(wk, gc, j->z, j->x, j->y, filetype);
+			wk->written++;
+		}
+	} else {
+		int xx, yy;
+		for (xx = 0; xx < j->metatile; xx++) {
+			for (yy = 0; yy < j->metatile; yy++) {
+				struct graphics *tile = graphics_crop(gc, xx * tilesize, yy * tilesize, tilesize, tilesize);
+				if (tile == NULL) {
+					fprintf(stderr, "Can't make %s tiles from a metatile\n", filetype);
+					exit(EXIT_FAILURE);
+				}
+
+				if (graphics_blank(tile)) {
+					wk->blank++;
+				} else {
+					write_tile(wk, tile, j->z, j->x + xx, j->y + yy, filetype);
+					wk->written++;
+				}
+
+				graphics_free(tile);
+			}
+		}
+	}
+
+	graphics_free(gc);
+}
+
+static void *run_worker(void *v) {
+	struct worker *wk = v;
+	struct work *w = wk->work;
+
+	while (1) {
+		long long j;
+
+		if (!take(&w->deques[wk->id], w->jobs, &j)) {
+			if (!steal(w, wk->id)) {
+				break;
+			}
+
+			wk->steals++;
+			continue;
+		}
+
+		run_job(wk, &w->jobs[j]);
+		wk->jobs++;
+
+		pthread_mutex_lock(&w->lock);
+		w->done++;
+		int progress = 100 * w->done / w->njobs;
+		if (progress != w->progress) {
+			w->progress = progress;
+			fprintf(stderr, "  %d%%\r", progress);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+
+	return NULL;
+}
+
+// The quadkey at maxzoom and the number of records for each tile that
+// any of the datasets has records in, from the occupancy if it is deep
+// enough, and otherwise by reading the levels
+static unsigned long long *list_tiles(struct file *files, int nfiles, int maxzoom, long long *ntiles) {
+	unsigned long long *all = NULL;
+	long long n = 0;
+	int i;
+
+	for (i = 0; i < nfiles; i++) {
+		struct dataset *ds = files[i].ds;
+		struct occupancy *occ = occupancy_open(ds);
+		unsigned long long *entries;
+		long long tiles;
+		int zoom = maxzoom;
+
+		if (zoom > ds->mapbits / 2) {
+			zoom = ds->mapbits / 2;
+		}
+
+		if (occ != NULL && occ->zoom >= zoom) {
+			tiles = occ->tiles;
+			entries = fmalloc(2 * tiles * sizeof(unsigned long long) + 1);
+			memcpy(entries, occ->entries, 2 * tiles * sizeof(unsigned long long));
+
+			long long t;
+			for (t = 0; t < tiles; t++) {
+				entries[2 * t] >>= 2 * (occ->zoom - zoom);
+			}
+		} else {
+			fprintf(stderr, "%s: no occupancy as deep as zoom %d; reading the levels\n", ds->name, zoom);
+			entries = occupancy_build(ds, zoom, &tiles);
+		}
+
+		if (occ != NULL) {
+			occupancy_close(occ);
+		}
+
+		all = realloc(all, 2 * (n + tiles) * sizeof(unsigned long long) + 1);
+		if (all == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+
+		// Tiles of a dataset with fewer mapbits are all of their
+		// children at maxzoom, but the first one stands for them
+		long long t;
+		for (t = 0; t < tiles; t++) {
+			all[2 * (n + t)] = entries[2 * t] << 2 * (maxzoom - zoom);
+			all[2 * (n + t) + 1] = entries[2 * t + 1];
+		}
+		n += tiles;
+
+		free(entries);
+	}
+
+	*ntiles = n;
+	return all;
+}
+
+static struct job *addjob(struct job *jobs, long long *njobs, long long *nalloc, int z, unsigned int x, unsigned int y, int metatile, int maxzoom) {
+	if (*njobs >= *nalloc) {
+		*nalloc = *nalloc * 2 + 1024;
+		jobs = realloc(jobs, *nalloc * sizeof(struct job));
+		if (jobs == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct job *j = &jobs[(*njobs)++];
+	j->z = z;
+	j->x = x;
+	j->y = y;
+	j->metatile = metatile;
+	j->cost = TILE_COST * metatile * metatile;
+	j->order = zxy2key(z, x, y) << 2 * (maxzoom - z);
+
+	return jobs;
+}
+
+// How many records start within the quadkeys from start to end at maxzoom
+static long long count_within(unsigned long long *tiles, long long ntiles, unsigned long long start, unsigned long long end) {
+	long long lo = 0, hi = ntiles;
+
+	while (lo < hi) {
+		long long mid = lo + (hi - lo) / 2;
+
+		if (tiles[2 * mid] < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	long long count = 0;
+	for (; lo < ntiles && tiles[2 * lo] <= end; lo++) {
+		count += tiles[2 * lo + 1];
+	}
+
+	return count;
+}
+
+// The blocks for the tiles listed in the file, one per line, as the last
+// three numbers on the line, so that the output of enumerate or dirty works
+static struct job *listed_jobs(char *fname, unsigned long long *tiles, long long ntiles, int minzoom, int maxzoom, int metatile,
+			       unsigned int left, unsigned int top, unsigned int right, unsigned int bottom, long long *njobs) {
+	FILE *f = strcmp(fname, "-") == 0 ? stdin : fopen(fname, "r");
+	if (f == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct job *jobs = NULL;
+	long long nalloc = 0;
+	char s[2000];
+	long long line = 0;
+
+	*njobs = 0;
+
+	while (fgets(s, sizeof(s), f) != NULL) {
+		line++;
+
+		// Find the start of the third word from the end
+		char *cp = s + strlen(s);
+		int words = 0;
+		while (cp > s && words < 3) {
+			while (cp > s && isspace((unsigned char) cp[-1])) {
+				cp--;
+			}
+			while (cp > s && !isspace((unsigned char) cp[-1])) {
+				cp--;
+			}
+			words++;
+		}
+
+		int z;
+		unsigned int x, y;
+		if (sscanf(cp, "%d %u %u", &z, &x, &y) != 3) {
+			fprintf(stderr, "%s:%lld: not a tile: %s", fname, line, s);
+			exit(EXIT_FAILURE);
+		}
+
+		if (z < minzoom || z > maxzoom || x >= (1LL << z) || y >= (1LL << z)) {
+			continue;
+		}
+		if (x < (unsigned long long) left >> (32 - z) || x > (unsigned long long) right >> (32 - z) ||
+		    y < (unsigned long long) top >> (32 - z) || y > (unsigned long long) bottom >> (32 - z)) {
+			continue;
+		}
+
+		int m = metatile;
+		while (m > 1 && m > (1LL << z)) {
+			m /= 2;
+		}
+
+		x = x / m * m;
+		y = y / m * m;
+
+		jobs = addjob(jobs, njobs, &nalloc, z, x, y, m, maxzoom);
+
+		int shift = 0;
+		while ((1 << shift) < m) {
+			shift++;
+		}
+
+		unsigned long long start = zxy2key(z - shift, x >> shift, y >> shift) << 2 * (maxzoom - z + shift);
+		unsigned long long end = start + ((1ULL << 2 * (maxzoom - z + shift)) - 1);
+		jobs[*njobs - 1].cost += count_within(tiles, ntiles, start, end);
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	return jobs;
+}
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	int maxzoom = -1;
+	int minzoom = 0;
+	int metatile = 1;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	char *outdir = NULL;
+	char *listfile = NULL;
+	int dedup = 0;
+
+	unsigned int left = 0, top = 0, right = UINT_MAX, bottom = UINT_MAX;
+
+	int nfiles = 0;
+	struct file files[argc];
+
+	while ((i = getopt(argc, argv, "ab:B:c:C:e:f:gG:Hk:l:L:mM:o:O:p:P:R:sS:t:T:u:wx:z:Z:")) != -1) {
+		switch (i) {
+		case 'z':
+			maxzoom = atoi(optarg);
+			break;
+
+		case 'Z':
+			minzoom = atoi(optarg);
+			break;
+
+		case 'R':
+			{
+				double minlat, minlon, maxlat, maxlon;
+
+				if (sscanf(optarg, "%lf,%lf,%lf,%lf", &minlat, &minlon,
+						&maxlat, &maxlon) != 4) {
+					usage(argv);
+				}
+
+				latlon2tile(minlat, minlon, 32, &left, &bottom);
+				latlon2tile(maxlat, maxlon, 32, &right, &top);
+			}
+			break;
+
+		case 'k':
+			metatile = atoi(optarg);
+			if (metatile < 1 || (metatile & (metatile - 1)) != 0) {
+				fprintf(stderr, "Metatile size %s is not a power of 2\n", optarg);
+				usage(argv);
+			}
+			break;
+
+		case 'P':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				usage(argv);
+			}
+			break;
+
+		case 'f':
+			files[nfiles++].name = optarg;
+			break;
+
+		case 'o':
+			outdir = optarg;
+			break;
+
+		case 'u':
+			listfile = optarg;
+			break;
+
+		case 'H':
+			dedup = 1;
+			break;
+
+		default:
+			switch (draw_option(i, optarg)) {
+			case 0:
+				fprintf(stderr, "Unknown option %c\n", i);
+				usage(argv);
+				break;
+
+			case -1:
+				usage(argv);
+			}
+		}
+	}
+
+	if (argc - optind != 1 || outdir == NULL) {
+		usage(argv);
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	// The main file goes first, so that it names the tileset
+	// and its style options apply as they do in render
+	memmove(files + 1, files, nfiles * sizeof(struct file));
+	files[0].name = argv[optind];
+	nfiles++;
+
+	for (i = 0; i < nfiles; i++) {
+		files[i].ds = dataset_open(files[i].name);
+		files[i].mapbits = files[i].ds->mapbits;
+		files[i].metabits = files[i].ds->metabits;
+		files[i].maxn = files[i].ds->maxn;
+
+		files[i].bytes = (files[i].mapbits + files[i].metabits + 7) / 8;
+	}
+
+	if (maxzoom < 0) {
+		maxzoom = files[0].mapbits / 2 - 8;
+	}
+	if (maxzoom < 0) {
+		maxzoom = 0;
+	}
+	if (maxzoom > 30) {
+		maxzoom = 30;
+	}
+	if (minzoom > maxzoom) {
+		fprintf(stderr, "Minimum zoom %d is above maximum zoom %d\n", minzoom, maxzoom);
+		usage(argv);
+	}
+
+	struct writer *writer = writer_open(outdir, dedup);
+
+	long long ntiles;
+	unsigned long long *tiles = list_tiles(files, nfiles, maxzoom, &ntiles);
+
+	// Drop the tiles outside the bounds, and find the block of each
+	// remaining one at every zoom. The blocks come out in order
+	// within each zoom, so the duplicates are adjacent.
+
+	struct job *jobs = NULL;
+	long long njobs = 0;
+	long long t;
+
+	for (t = 0; t < ntiles; t++) {
+		unsigned int x, y;
+		key2zxy(tiles[2 * t], maxzoom, &x, &y);
+
+		if (x < (unsigned long long) left >> (32 - maxzoom) || x > (unsigned long long) right >> (32 - maxzoom) ||
+		    y < (unsigned long long) top >> (32 - maxzoom) || y > (unsigned long long) bottom >> (32 - maxzoom)) {
+			continue;
+		}
+
+		tiles[2 * njobs] = tiles[2 * t];
+		tiles[2 * njobs + 1] = tiles[2 * t + 1];
+		njobs++;
+	}
+	ntiles = njobs;
+
+	qsort(tiles, ntiles, 2 * sizeof(unsigned long long), tilecmp);
+
+	njobs = 0;
+	long long nalloc = 0;
+	int z;
+
+	if (listfile != NULL) {
+		jobs = listed_jobs(listfile, tiles, ntiles, minzoom, maxzoom, metatile, left, top, right, bottom, &njobs);
+	} else {
+		for (z = minzoom; z <= maxzoom; z++) {
+			int m = metatile;
+			while (m > 1 && m > (1LL << z)) {
+				m /= 2;
+			}
+
+			long long first = njobs;
+
+			for (t = 0; t < ntiles; t++) {
+				unsigned int x, y;
+				key2zxy(tiles[2 * t] >> 2 * (maxzoom - z), z, &x, &y);
+				x = x / m * m;
+				y = y / m * m;
+
+				if (njobs > first && jobs[njobs - 1].x == x && jobs[njobs - 1].y == y) {
+					jobs[njobs - 1].cost += tiles[2 * t + 1];
+					continue;
+				}
+
+				jobs = addjob(jobs, &njobs, &nalloc, z, x, y, m, maxzoom);
+				jobs[njobs - 1].cost += tiles[2 * t + 1];
+			}
+		}
+	}
+
+	free(tiles);
+	qsort(jobs, njobs, sizeof(struct job), jobcmp);
+
+	// A list can name several tiles of the same block
+	if (listfile != NULL) {
+		long long out = 0;
+
+		for (t = 0; t < njobs; t++) {
+			if (out == 0 || jobcmp(&jobs[out - 1], &jobs[t]) != 0) {
+				jobs[out++] = jobs[t];
+			}
+		}
+
+		njobs = out;
+	}
+
+	// Give each worker a run of jobs with an even share of the cost
+
+	long long total = 0;
+	for (t = 0; t < njobs; t++) {
+		total += jobs[t].cost;
+	}
+
+	struct work w;
+	w.jobs = jobs;
+	w.njobs = njobs;
+	w.threads = threads;
+	w.files = files;
+	w.nfiles = nfiles;
+	w.writer = writer;
+	w.done = 0;
+	w.progress = -1;
+	pthread_mutex_init(&w.lock, NULL);
+
+	w.deques = fmalloc(threads * sizeof(struct deque));
+	struct worker *workers = fmalloc(threads * sizeof(struct worker));
+
+	long long sofar = 0;
+	t = 0;
+	for (i = 0; i < threads; i++) {
+		w.deques[i].start = t;
+		w.deques[i].cost = 0;
+
+		while (t < njobs && (i == threads - 1 || sofar + jobs[t].cost / 2 <= total * (i + 1) / threads)) {
+			w.deques[i].cost += jobs[t].cost;
+			sofar += jobs[t].cost;
+			t++;
+		}
+
+		w.deques[i].end = t;
+		pthread_mutex_init(&w.deques[i].lock, NULL);
+	}
+
+	double start = now();
+
+	for (i = 0; i < threads; i++) {
+		memset(&workers[i], 0, sizeof(struct worker));
+		workers[i].id = i;
+		workers[i].work = &w;
+
+		if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	long long written = 0, blank = 0, bytes = 0;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_join(workers[i].thread, NULL) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+
+		written += workers[i].written;
+		blank += workers[i].blank;
+		bytes += workers[i].bytes;
+	}
+
+	double elapsed = now() - start;
+	if (njobs > 0) {
+		fprintf(stderr, "\n");
+	}
+
+	struct dedup_stats stats;
+	dedup = writer_close(writer, files[0].name, &stats);
+
+	fprintf(stderr, "%lld tiles in %lld jobs: %lld written, %lld blank, %lld bytes in %.2f seconds\n",
+		written + blank, njobs, written, blank, bytes, elapsed);
+	if (dedup) {
+		dedup_report(&stats);
+	}
+	for (i = 0; i < threads; i++) {
+		fprintf(stderr, "  thread %d: %lld jobs, %lld steals\n", i, workers[i].jobs, workers[i].steals);
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		dataset_close(files[i].ds);
+	}
+	free(jobs);
+	free(workers);
+	free(w.deques);
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
+#include "util.h"
+#include "dataset.h"
+#include "summary.h"
+#include "occupancy.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-z zoom] [-m metadata-bits] [-cs] [-i zoom] -o destdir file\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+// Records written out at once
+#define OUTBUF 65536
+
+struct transcode {
+	struct dataset *ds;
+	char *destdir;
+	int mapbits;
+	int metabits;
+	int flags;		// of the output
+
+	long long clamped;	// metadata too big for the new metabits
+};
+
+// Keep the high bits of a number from bits wide to width wide,
+// which is the same as dropping or adding pairs of low y,x bits
+static unsigned long long rescale(unsigned long long v, int bits, int width) {
+	if (width < bits) {
+		return bits - width >= 64 ? 0 : v >> (bits - width);
+	} else {
+		return width - bits >= 64 ? 0 : v << (width - bits);
+	}
+}
+
+// Rewrite one record from level skip of the source to level
+// newskip of the new encoding. out must be zeroed.
+static void convert(struct transcode *t, const unsigned char *rec, unsigned char *out, int components, int skip, int newskip) {
+	int mapbits = t->ds->mapbits, metabits = t->ds->metabits;
+	int bytes = bytesfor(mapbits, metabits, components, skip);
+	long long bit = 0, outbit = 0;
+	int j;
+
+	// The bits that all the points have in common, only fewer of
+	// them if they have more in common than the new encoding has
+	unsigned long long common = getbits(rec, bytes, &bit, 2 * skip);
+	putbits(out, &outbit, 2 * newskip, rescale(common, 2 * skip, 2 * newskip));
+
+	for (j = 0; j < components; j++) {
+		unsigned long long v = getbits(rec, bytes, &bit, mapbits - 2 * skip);
+
+		if (newskip == skip) {
+			putbits(out, &outbit, t->mapbits - 2 * newskip, rescale(v, mapbits - 2 * skip, t->mapbits - 2 * newskip));
+		}
+	}
+
+	unsigned long long meta = getbits(rec, bytes, &bit, metabits);
+	if (t->metabits < 64 && meta >= (1ULL << t->metabits)) {
+		meta = (1ULL << t->metabits) - 1;
+		t->clamped++;
+	}
+	putbits(out, &outbit, t->metabits, meta);
+}
+
+// Whether two records have the same first point
+static int samepoint(const unsigned char *a, const unsigned char *b, int bits) {
+	if (memcmp(a, b, bits / 8) != 0) {
+		return 0;
+	}
+	if (bits % 8 == 0) {
+		return 1;
+	}
+
+	unsigned char mask = 0xFF << (8 - bits % 8);
+	return (a[bits / 8] & mask) == (b[bits / 8] & mask);
+}
+
+// The records came out in order of their first point, because fewer bits
+// of it sort the same way, but not always in order after that. Sort only
+// the runs with the same first point that need it, or everything if the
+// records came from more than one source level.
+static void resort(char *fname, int bytes, int mapbits, int whole) {
+	int fd = open(fname, O_RDWR);
+	if (fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	long long records = st.st_size / bytes;
+	if (records == 0) {
+		close(fd);
+		return;
+	}
+
+	unsigned char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	gSortBytes = bytes;
+
+	if (whole) {
+		qsort(map, records, bytes, bufcmp);
+	} else {
+		long long start = 0, i;
+		int sorted = 1;
+
+		for (i = 1; i <= records; i++) {
+			if (i == records || !samepoint(map + start * bytes, map + i * bytes, mapbits)) {
+				if (!sorted) {
+					qsort(map + start * bytes, i - start, bytes, bufcmp);
+				}
+
+				start = i;
+				sorted = 1;
+			} else if (memcmp(map + (i - 1) * bytes, map + i * bytes, bytes) > 0) {
+				sorted = 0;
+			}
+		}
+	}
+
+	if (munmap(map, st.st_size) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+// Make level newskip of the new dataset from the source levels that go into it:
+// the same one, and if the new encoding has fewer bits, all the ones above it too
+static void transcode_level(struct transcode *t, int components, int newskip) {
+	int oldhalf = t->ds->mapbits / 2, newhalf = t->mapbits / 2;
+	int bytes = bytesfor(t->mapbits, t->metabits, components, newskip);
+	int last = newskip == newhalf ? oldhalf : newskip;
+	int sources = 0;
+	int sorted = 1;
+
+	char outfname[strlen(t->destdir) + 1 + 5 + 1 + 5 + 1];
+	sprintf(outfname, "%s/%d,%d", t->destdir, components, newskip);
+	FILE *out = NULL;
+
+	unsigned char *buf = NULL;
+	size_t used = 0;
+	unsigned char prev[bytes];	// the last record, to see if they are in order
+	int haveprev = 0;
+
+	int skip;
+	for (skip = newskip; skip <= last; skip++) {
+		struct level lv;
+
+		if (!level_open(t->ds, components, skip, &lv)) {
+			continue;
+		}
+		if (lv.records == 0) {
+			level_close(&lv);
+			continue;
+		}
+
+		if (out == NULL) {
+			printf("transcoding zoom level %d for point count %d (%d bytes)\n", newskip, components, bytes);
+
+			out = fopen(outfname, "wb");
+			if (out == NULL) {
+				perror(outfname);
+				exit(EXIT_FAILURE);
+			}
+
+			buf = malloc((size_t) OUTBUF * bytes);
+			if (buf == NULL) {
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		sources++;
+
+		level_advise(&lv, 0, lv.records - 1, POSIX_MADV_SEQUENTIAL, 1);
+
+		long long i;
+		for (i = 0; i < lv.records; i++) {
+			if (used == OUTBUF) {
+				if (fwrite(buf, bytes, used, out) != used) {
+					perror(outfname);
+					exit(EXIT_FAILURE);
+				}
+				used = 0;
+			}
+
+			unsigned char *rec = buf + used * bytes;
+			memset(rec, '\0', bytes);
+			convert(t, level_full_record(&lv, i), rec, components, skip, newskip);
+
+			if (haveprev && memcmp(prev, rec, bytes) > 0) {
+				sorted = 0;
+			}
+			memcpy(prev, rec, bytes);
+			haveprev = 1;
+			used++;
+		}
+
+		level_close(&lv);
+	}
+
+	if (out == NULL) {
+		return;
+	}
+
+	if (fwrite(buf, bytes, used, out) != used || fclose(out) != 0) {
+		perror(outfname);
+		exit(EXIT_FAILURE);
+	}
+	free(buf);
+
+	if (!sorted) {
+		resort(outfname, bytes, t->mapbits, sources > 1);
+	}
+
+	level_finish(outfname, t->mapbits, t->metabits, components, newskip, t->flags);
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	char *destdir = NULL;
+	int zoom = -1;
+	int metabits = -1;
+	int compress = 0;
+	int split = 0;
+	int occzoom = -1;
+
+	while ((i = getopt(argc, argv, "z:m:o:csi:")) != -1) {
+		switch (i) {
+		case 'z':
+			zoom = atoi(optarg);
+			break;
+
+		case 'm':
+			metabits = atoi(optarg);
+			break;
+
+		case 'o':
+			destdir = optarg;
+			break;
+
+		case 'c':
+			compress = 1;
+			break;
+
+		case 's':
+			split = 1;
+			break;
+
+		case 'i':
+			occzoom = atoi(optarg);
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (argc - optind != 1 || destdir == NULL) {
+		usage(argv);
+	}
+
+	struct transcode t;
+	t.ds = dataset_open(argv[optind]);
+	t.destdir = destdir;
+	t.mapbits = zoom < 0 ? t.ds->mapbits : 2 * (zoom + 8);
+	t.metabits = metabits < 0 ? t.ds->metabits : metabits;
+	t.clamped = 0;
+
+	if (t.mapbits <= 16 || t.mapbits > 64) {
+		fprintf(stderr, "%s: Zoom level (-z) must be from 1 to 24\n", argv[0]);
+		usage(argv);
+	}
+	if (t.metabits > 64) {
+		fprintf(stderr, "%s: Can't have more than 64 bits of metadata (-m)\n", argv[0]);
+		usage(argv);
+	}
+
+	if (mkdir(destdir, 0777) != 0) {
+		perror(destdir);
+		exit(EXIT_FAILURE);
+	}
+
+	// Without any metadata there is nothing to split off
+	if (t.metabits == 0) {
+		split = 0;
+	}
+	t.flags = (compress ? DATASET_COMPRESSED : 0) | (split ? DATASET_SPLIT : 0);
+
+	dataset_write_meta(destdir, t.mapbits, t.metabits, t.ds->maxn, t.flags);
+
+	int z_lookup;
+	for (z_lookup = 0; z_lookup <= t.mapbits / 2; z_lookup++) {
+		for (i = 1; i <= t.ds->maxn; i++) {
+			if (i == 1 && z_lookup != 0) {
+				continue;
+			}
+
+			transcode_level(&t, i, z_lookup);
+		}
+	}
+
+	if (t.clamped > 0) {
+		fprintf(stderr, "%lld metadata values were too big for %d bits and were reduced to %llu\n",
+			t.clamped, t.metabits, (1ULL << t.metabits) - 1);
+	}
+
+	if (occzoom < 0) {
+		occzoom = t.mapbits / 2 - 8;
+	}
+	occupancy_write(destdir, occzoom);
+
+	dataset_close(t.ds);
+	return 0;
+}
@@ -1,9 +1,11 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "util.h"
 
-int gSortBytes;
+// Per thread, so that several threads can search files of different widths
+__thread int gSortBytes;
 int bufcmp(const void *v1, const void *v2) {
 	return memcmp(v1, v2, gSortBytes);
 }
@@ -60,6 +62,50 @@ void wxy2fxy(long long wx, long long wy, double *ox, double *oy, int z, int x, i
 	*oy = (double) wy / (1LL << (32 - z));
 }
 
+// Call tile() for each tile at the zoom with the shift that the segment
+// between world coordinates passes through, walking from one tile to the
+// next across whichever edge the segment reaches first. Where it goes
+// exactly through a corner, the tiles on both sides of the corner count
+// too, as they would when drawn.
+void supercover(int shift, long long x0, long long y0, long long x1, long long y1, void (*tile)(void *arg, long long x, long long y), void *arg) {
+	long long cx = x0 >> shift, cy = y0 >> shift;
+	long long ex = x1 >> shift, ey = y1 >> shift;
+	long long dx = x1 - x0, dy = y1 - y0;
+	int sx = dx > 0 ? 1 : -1;
+	int sy = dy > 0 ? 1 : -1;
+
+	tile(arg, cx, cy);
+
+	while (cx != ex || cy != ey) {
+		if (cx == ex) {
+			cy += sy;
+		} else if (cy == ey) {
+			cx += sx;
+		} else {
+			// Compare how far along the segment the next vertical
+			// and horizontal edges are, without dividing
+			long long bx = (sx > 0 ? cx + 1 : cx) << shift;
+			long long by = (sy > 0 ? cy + 1 : cy) << shift;
+
+			unsigned __int128 tx = (unsigned __int128) llabs(bx - x0) * llabs(dy);
+			unsigned __int128 ty = (unsigned __int128) llabs(by - y0) * llabs(dx);
+
+			if (tx < ty) {
+				cx += sx;
+			} else if (ty < tx) {
+				cy += sy;
+			} else {
+				tile(arg, cx + sx, cy);
+				tile(arg, cx, cy + sy);
+				cx += sx;
+				cy += sy;
+			}
+		}
+
+		tile(arg, cx, cy);
+	}
+}
+
 // Convert world coordinates to a bit stream
 void xy2buf(unsigned int x32, unsigned int y32, unsigned char *buf, int *offbits, int n, int skip) {
 	int i;
@@ -157,8 +203,230 @@ void meta2buf(int bits, long long data, unsigned char *buf, int *offbits, int ma
 	}
 }
 
+// How many bits of a record are its coordinates. The metadata comes after them.
+int geometry_bits(int mapbits, int components, int z_lookup) {
+	return mapbits + (mapbits - 2 * z_lookup) * (components - 1);
+}
+
 int bytesfor(int mapbits, int metabits, int components, int z_lookup) {
-	int bits = mapbits + metabits + (mapbits - 2 * z_lookup) * (components - 1);
+	int bits = geometry_bits(mapbits, components, z_lookup) + metabits;
 
 	return (bits + 7) / 8;
 }
+
+// Quadkey of a tile at zoom z, with the same y-before-x interleaving as xy2buf
+unsigned long long zxy2key(unsigned int z, unsigned int x, unsigned int y) {
+	unsigned long long key = 0;
+	int i;
+
+	for (i = z - 1; i >= 0; i--) {
+		key = (key << 2) | (((y >> i) & 1) << 1) | ((x >> i) & 1);
+	}
+
+	return key;
+}
+
+void key2zxy(unsigned long long key, unsigned int z, unsigned int *x, unsigned int *y) {
+	int i;
+
+	*x = *y = 0;
+	for (i = z - 1; i >= 0; i--) {
+		*y |= ((key >> (2 * i + 1)) & 1) << i;
+		*x |= ((key >> (2 * i)) & 1) << i;
+	}
+}
+
+static void addrange(struct range *ranges, int *n, int max, unsigned long long start, unsigned long long end) {
+	if (*n > 0 && ranges[*n - 1].end + 1 == start) {
+		ranges[*n - 1].end = end;
+	} else if (*n < max) {
+		ranges[*n].start = start;
+		ranges[*n].end = end;
+		(*n)++;
+	}
+}
+
+static void quadranges(unsigned int z, unsigned int zq, unsigned int xq, unsigned int yq, long long x1, long long y1, long long x2, long long y2, struct range *ranges, int *n, int max) {
+	int shift = z - zq;
+	long long qx1 = (long long) xq << shift, qx2 = qx1 + (1LL << shift) - 1;
+	long long qy1 = (long long) yq << shift, qy2 = qy1 + (1LL << shift) - 1;
+
+	if (qx2 < x1 || qx1 > x2 || qy2 < y1 || qy1 > y2) {
+		return;
+	}
+
+	if (qx1 >= x1 && qx2 <= x2 && qy1 >= y1 && qy2 <= y2) {
+		unsigned long long start = zxy2key(zq, xq, yq) << (2 * shift);
+		addrange(ranges, n, max, start, start + ((1ULL << (2 * shift)) - 1));
+		return;
+	}
+
+	// Children in quadkey order: y bit first, then x
+	quadranges(z, zq + 1, 2 * xq,     2 * yq,     x1, y1, x2, y2, ranges, n, max);
+	quadranges(z, zq + 1, 2 * xq + 1, 2 * yq,     x1, y1, x2, y2, ranges, n, max);
+	quadranges(z, zq + 1, 2 * xq,     2 * yq + 1, x1, y1, x2, y2, ranges, n, max);
+	quadranges(z, zq + 1, 2 * xq + 1, 2 * yq + 1, x1, y1, x2, y2, ranges, n, max);
+}
+
+// Cover the tiles x1..x2, y1..y2 of zoom z (clipped to the world)
+// with the fewest contiguous quadkey ranges, in ascending order.
+// Needs room for at most one range per tile in the rectangle.
+int tiles2ranges(unsigned int z, long long x1, long long y1, long long x2, long long y2, struct range *ranges, int max) {
+	long long last = (1LL << z) - 1;
+	int n = 0;
+
+	if (x1 < 0) {
+		x1 = 0;
+	}
+	if (y1 < 0) {
+		y1 = 0;
+	}
+	if (x2 > last) {
+		x2 = last;
+	}
+	if (y2 > last) {
+		y2 = last;
+	}
+
+	if (x1 <= x2 && y1 <= y2) {
+		quadranges(z, 0, 0, 0, x1, y1, x2, y2, ranges, &n, max);
+	}
+
+	return n;
+}
+
+// Take the keys from start to end out of a sorted list of ranges.
+// They must all be within one of the ranges, which is split if needed,
+// so there must be room for one more range than n.
+int removerange(struct range *ranges, int n, unsigned long long start, unsigned long long end) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (start >= ranges[i].start && end <= ranges[i].end) {
+			if (start == ranges[i].start && end == ranges[i].end) {
+				memmove(ranges + i, ranges + i + 1, (n - i - 1) * sizeof(struct range));
+				return n - 1;
+			} else if (start == ranges[i].start) {
+				ranges[i].start = end + 1;
+			} else if (end == ranges[i].end) {
+				ranges[i].end = start - 1;
+			} else {
+				memmove(ranges + i + 2, ranges + i + 1, (n - i - 1) * sizeof(struct range));
+				ranges[i + 1].start = end + 1;
+				ranges[i + 1].end = ranges[i].end;
+				ranges[i].end = start - 1;
+				return n + 1;
+			}
+
+			break;
+		}
+	}
+
+	return n;
+}
+
+// Fill startbuf and endbuf with the bit patterns for the start and end of a range of zoom z tiles
+void range2bufs(unsigned int z, const struct range *r, unsigned char *startbuf, unsigned char *endbuf, int bytes) {
+	unsigned char scratch[bytes];
+	unsigned int x, y;
+
+	key2zxy(r->start, z, &x, &y);
+	zxy2bufs(z, x, y, startbuf, scratch, bytes);
+
+	key2zxy(r->end, z, &x, &y);
+	zxy2bufs(z, x, y, scratch, endbuf, bytes);
+}
+
+// Turn a range of zoom z quadkeys into the range of first 64 bits of
+// records, which start with the bits of the first point, that fall
+// within those tiles. A z32 tile is a single key.
+void range2keys(unsigned int z, struct range *r) {
+	if (z == 0) {
+		r->start = 0;
+		r->end = ~0ULL;
+	} else {
+		r->start <<= 64 - 2 * z;
+		r->end = (r->end << (64 - 2 * z)) | (z == 32 ? 0 : ~0ULL >> (2 * z));
+	}
+}
+
+// The ranges of first 64 bits of records within the bounds, given as
+// z32 tile coordinates. They are of the tiles that cover the bounds at
+// the deepest zoom up to maxz that needs no more than max of them.
+// Returns -1 if the bounds are inside out.
+int bounds2ranges(unsigned int left, unsigned int top, unsigned int right, unsigned int bottom, int maxz, struct range *ranges, int max) {
+	long long x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+	int z, n, i;
+
+	if (left > right || top > bottom) {
+		return -1;
+	}
+
+	for (z = maxz; z > 0; z--) {
+		x1 = (long long) left >> (32 - z);
+		y1 = (long long) top >> (32 - z);
+		x2 = (long long) right >> (32 - z);
+		y2 = (long long) bottom >> (32 - z);
+
+		// Each side first, so that the product can't overflow at z32
+		if (x2 - x1 < max && y2 - y1 < max && (x2 - x1 + 1) * (y2 - y1 + 1) <= max) {
+			break;
+		}
+	}
+	if (z == 0) {
+		x1 = y1 = x2 = y2 = 0;
+	}
+
+	n = tiles2ranges(z, x1, y1, x2, y2, ranges, max);
+	for (i = 0; i < n; i++) {
+		range2keys(z, &ranges[i]);
+	}
+
+	return n;
+}
+
+// Add a range to the end of a list that grows as needed
+void appendrange(struct range **ranges, int *n, int *nalloc, unsigned long long start, unsigned long long end) {
+	if (*n >= *nalloc) {
+		*nalloc = *nalloc * 2 + 1024;
+		*ranges = realloc(*ranges, *nalloc * sizeof(struct range));
+		if (*ranges == NULL) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	(*ranges)[*n].start = start;
+	(*ranges)[*n].end = end;
+	(*n)++;
+}
+
+static int rangecmp(const void *v1, const void *v2) {
+	const struct range *r1 = v1;
+	const struct range *r2 = v2;
+
+	if (r1->start != r2->start) {
+		return r1->start < r2->start ? -1 : 1;
+	}
+	return 0;
+}
+
+// Sort the ranges and join the ones that overlap or touch.
+// Returns how many are left.
+int joinranges(struct range *ranges, int n) {
+	int i, out = 0;
+
+	qsort(ranges, n, sizeof(struct range), rangecmp);
+
+	for (i = 0; i < n; i++) {
+		if (out > 0 && (ranges[out - 1].end == ~0ULL || ranges[i].start <= ranges[out - 1].end + 1)) {
+			if (ranges[i].end > ranges[out - 1].end) {
+				ranges[out - 1].end = ranges[i].end;
+			}
+		} else {
+			ranges[out++] = ranges[i];
+		}
+	}
+
+	return out;
+}
@@ -1,4 +1,4 @@
-extern int gSortBytes;
+extern __thread int gSortBytes;
 int bufcmp(const void *v1, const void *v2);
 void *search(const void *key, const void *base, size_t nel, size_t width, int (*cmp)(const void *, const void *));
 
@@ -6,9 +6,26 @@ void latlon2tile(double lat, double lon, int zoom, unsigned int *x, unsigned int
 void tile2latlon(unsigned int x, unsigned int y, int zoom, double *lat, double *lon);
 
 void wxy2fxy(long long wx, long long wy, double *ox, double *oy, int z, int x, int y);
+void supercover(int shift, long long x0, long long y0, long long x1, long long y1, void (*tile)(void *arg, long long x, long long y), void *arg);
 void xy2buf(unsigned int x32, unsigned int y32, unsigned char *buf, int *offbits, int n, int skip);
 void zxy2bufs(unsigned int z, unsigned int x, unsigned int y, unsigned char *startbuf, unsigned char *endbuf, int bytes);
 void buf2xys(const unsigned char *const buf, const int mapbits, const int metabits, const int skip, const int n, unsigned int *x, unsigned int *y, unsigned long long *meta);
 void meta2buf(int bits, long long data, unsigned char *buf, int *offbits, int max);
 
+int geometry_bits(int mapbits, int components, int z_lookup);
 int bytesfor(int mapbits, int metabits, int components, int z_lookup);
+
+struct range {
+	unsigned long long start;
+	unsigned long long end;
+};
+
+unsigned long long zxy2key(unsigned int z, unsigned int x, unsigned int y);
+void key2zxy(unsigned long long key, unsigned int z, unsigned int *x, unsigned int *y);
+int tiles2ranges(unsigned int z, long long x1, long long y1, long long x2, long long y2, struct range *ranges, int max);
+int removerange(struct range *ranges, int n, unsigned long long start, unsigned long long end);
+void range2bufs(unsigned int z, const struct range *r, unsigned char *startbuf, unsigned char *endbuf, int bytes);
+void range2keys(unsigned int z, struct range *r);
+int bounds2ranges(unsigned int left, unsigned int top, unsigned int right, unsigned int bottom, int maxz, struct range *ranges, int max);
+void appendrange(struct range **ranges, int *n, int *nalloc, unsigned long long start, unsigned long long end);
+int joinranges(struct range *ranges, int n);
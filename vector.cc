@@ -8,6 +8,8 @@
 #define YMAX 4096
 
 extern "C" {
+	#include <stdio.h>
+	#include <math.h>
 	#include "graphics.h"
 	#include "clip.h"
 }
@@ -147,6 +149,33 @@ struct graphics *graphics_init(int width, int height, char **filetype) {
 	return g;
 }
 
+// The layers dedup features as they are added, so they can only be drawn serially
+struct graphics *graphics_plane(struct graphics *gc) {
+	return NULL;
+}
+
+void graphics_merge(struct graphics *gc, struct graphics *plane) {
+}
+
+// Features are not kept by pixel, so there is nothing to cut up
+struct graphics *graphics_crop(struct graphics *gc, int x, int y, int width, int height) {
+	return NULL;
+}
+
+int graphics_blank(struct graphics *gc) {
+	return 0;
+}
+
+// Features are grouped into layers by their metadata
+int graphics_wants_meta(struct graphics *gc) {
+	return 1;
+}
+
+void graphics_free(struct graphics *gc) {
+	delete gc->e;
+	free(gc);
+}
+
 // from mapnik-vector-tile/src/vector_tile_compression.hpp
 static inline int compress(std::string const& input, std::string & output)
 {
@@ -178,7 +207,7 @@ static inline int compress(std::string const& input, std::string & output)
 
 static void op(env *e, int cmd, int x, int y);
 
-void out(struct graphics *gc, int transparency, double gamma, int invert, int color, int color2, int saturate, int mask, double color_cap, int cie) {
+void out(struct graphics *gc, FILE *fp, int transparency, double gamma, int invert, int color, int color2, int saturate, int mask, double color_cap, int cie) {
 	env *e = gc->e;
 	int i;
 
@@ -284,7 +313,7 @@ void out(struct graphics *gc, int transparency, double gamma, int invert, int co
 	std::string compressed;
 	compress(s, compressed);
 
-	std::cout << compressed;
+	fwrite(compressed.data(), 1, compressed.size(), fp);
 }
 
 static void op(env *e, int cmd, int x, int y) {
@@ -500,6 +529,46 @@ void drawBrush(double x, double y, struct graphics *gc, double bright, double br
 	drawPixel(x - .5, y - .5, gc, bright, hue, meta, tc);
 }
 
+// Every pixel whose center is within the disk, so that the disk covers
+// the same area as it does in a PNG
+void drawDisk(double x, double y, struct graphics *gc, double bright, double radius, double hue, long long meta, struct tilecontext *tc) {
+	// Only the part within the tile
+	double xmin = 0, ymin = 0;
+	double xmax = gc->width, ymax = gc->height;
+
+	int x0 = floor(x - radius), x1 = ceil(x + radius);
+	int y0 = floor(y - radius), y1 = ceil(y + radius);
+	if (x0 < xmin) {
+		x0 = xmin;
+	}
+	if (x1 > xmax) {
+		x1 = xmax;
+	}
+	if (y0 < ymin) {
+		y0 = ymin;
+	}
+	if (y1 > ymax) {
+		y1 = ymax;
+	}
+
+	int xx, yy, drawn = 0;
+	for (yy = y0; yy < y1; yy++) {
+		for (xx = x0; xx < x1; xx++) {
+			double dx = xx + .5 - x, dy = yy + .5 - y;
+
+			if (dx * dx + dy * dy < radius * radius) {
+				drawPixel(xx, yy, gc, bright, hue, meta, tc);
+				drawn = 1;
+			}
+		}
+	}
+
+	// A disk too small to cover any pixel's center is still there
+	if (!drawn && x >= xmin && x < xmax && y >= ymin && y < ymax) {
+		drawPixel(x - .5, y - .5, gc, bright, hue, meta, tc);
+	}
+}
+
 void setClip(struct graphics *gc, int x, int y, int w, int h) {
 
 }
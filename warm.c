@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "util.h"
+#include "dataset.h"
+
+void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-n] [-z max] [-Z min] [-b minlat,minlon,maxlat,maxlon] [-l lockzoom] file ...\n", argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+#define MAX_RANGES 4096
+
+// Prefetch the records of one level file that tiles from minzoom up to
+// maxzoom within the bounds will read. Rendering a tile reads the points
+// within the tile and its neighbors, and the lines of each higher level
+// within the tile. For each lower level, it reads the lines within the
+// tile at that level's zoom, so those cover more area.
+static void prefetch(struct level *lv, int components, int z_lookup, int minzoom, double *bounds) {
+	int z = minzoom;
+	if (components > 1 && z_lookup < z) {
+		z = z_lookup;
+	}
+
+	unsigned int x1, y1, x2, y2;
+	int pad = components == 1;
+
+	// Cover the bounds with tiles no smaller than necessary to keep
+	// the number of ranges within reason. Bigger tiles are a superset.
+
+	for (; z >= 0; z--) {
+		latlon2tile(bounds[2], bounds[1], z, &x1, &y1);
+		latlon2tile(bounds[0], bounds[3], z, &x2, &y2);
+
+		if (((long long) x2 - x1 + 1 + 2 * pad) * ((long long) y2 - y1 + 1 + 2 * pad) <= MAX_RANGES) {
+			break;
+		}
+	}
+	if (z < 0) {
+		z = 0;
+		x1 = y1 = x2 = y2 = 0;
+	}
+
+	struct range ranges[MAX_RANGES];
+	int nranges = tiles2ranges(z, (long long) x1 - pad, (long long) y1 - pad, (long long) x2 + pad, (long long) y2 + pad, ranges, MAX_RANGES);
+
+	unsigned char startbuf[lv->bytes];
+	unsigned char endbuf[lv->bytes];
+	int i;
+
+	for (i = 0; i < nranges; i++) {
+		range2bufs(z, &ranges[i], startbuf, endbuf, lv->bytes);
+
+		long long start = level_search(lv, startbuf);
+		long long end = level_search(lv, endbuf);
+
+		if (memcmp(level_record(lv, start), startbuf, lv->bytes) < 0) {
+			start++;
+		}
+
+		level_advise(lv, start, end, POSIX_MADV_WILLNEED, 1);
+	}
+}
+
+int main(int argc, char **argv) {
+	int i;
+	extern int optind;
+	extern char *optarg;
+
+	int maxzoom = -1;
+	int minzoom = 0;
+	int lockzoom = -1;
+	int noprefetch = 0;
+	double bounds[4] = { -85, -180, 85, 180 };
+
+	while ((i = getopt(argc, argv, "nz:Z:b:l:")) != -1) {
+		switch (i) {
+		case 'n':
+			noprefetch = 1;
+			break;
+
+		case 'z':
+			maxzoom = atoi(optarg);
+			break;
+
+		case 'Z':
+			minzoom = atoi(optarg);
+			break;
+
+		case 'b':
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf", &bounds[0], &bounds[1], &bounds[2], &bounds[3]) != 4) {
+				usage(argv);
+			}
+			break;
+
+		case 'l':
+			lockzoom = atoi(optarg);
+			break;
+
+		default:
+			usage(argv);
+		}
+	}
+
+	if (argc - optind < 1) {
+		usage(argv);
+	}
+
+	int locked = 0;
+
+	for (; optind < argc; optind++) {
+		char *fname = argv[optind];
+		struct dataset *ds = dataset_open(fname);
+		int heldhere = 0;
+
+		int max = maxzoom;
+		if (max < 0) {
+			max = ds->mapbits / 2 - 8;
+		}
+
+		// Rendering a tile reads lines down to 8 levels deeper
+		int depth = max + 8;
+		if (depth > ds->mapbits / 2) {
+			depth = ds->mapbits / 2;
+		}
+
+		int z_lookup;
+		for (z_lookup = 0; z_lookup <= depth; z_lookup++) {
+			int n;
+
+			for (n = 1; n <= ds->maxn; n++) {
+				if (n == 1 && z_lookup != 0) {
+					continue;
+				}
+
+				struct level lv;
+				if (!level_open(ds, n, z_lookup, &lv)) {
+					continue;
+				}
+
+				int held = 0;
+
+				// Every tile reads some of the lowest levels of lines,
+				// so keep them in memory for good if asked to
+				if (n > 1 && z_lookup <= lockzoom) {
+					if (dataset_lock(&lv.map) != 0 || (lv.split && dataset_lock(&lv.meta) != 0)) {
+						fprintf(stderr, "%s/%d,%d: can't lock: %s\n", fname, n, z_lookup, strerror(errno));
+					} else {
+						held = 1;
+						heldhere++;
+					}
+				} else if (!noprefetch && lv.records > 0) {
+					prefetch(&lv, n, z_lookup, minzoom, bounds);
+				}
+
+				long long size = lv.map.len + (lv.split ? lv.meta.len : 0);
+				long long resident = dataset_resident(&lv.map) + (lv.split ? dataset_resident(&lv.meta) : 0);
+
+				printf("%s %d,%d %lld %lld %.1f%%\n", fname, n, z_lookup, size, resident,
+				       size > 0 ? 100.0 * resident / size : 100.0);
+
+				// The locks only last as long as the mapping does
+				if (!held) {
+					level_close(&lv);
+				}
+			}
+		}
+
+		fflush(stdout);
+
+		if (heldhere == 0) {
+			dataset_close(ds);
+		}
+		locked += heldhere;
+	}
+
+	if (locked > 0) {
+		fprintf(stderr, "Holding %d level files in memory; interrupt to release them\n", locked);
+
+		while (1) {
+			pause();
+		}
+	}
+
+	return 0;
+}
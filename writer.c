@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "mbtiles.h"
+#include "dedup.h"
+#include "writer.h"
+
+struct writer {
+	char *outdir;
+	struct mbtiles *mb;	// if outdir is an MBTiles file
+	int dedup;
+
+	// Everything below is under lock
+	pthread_mutex_t lock;
+
+	// The z and z/x directories that are known to exist,
+	// as an open-addressed hash of dirkey()s
+	unsigned long long *dirs;
+	size_t ndirs;
+	size_t dirsize;
+
+	char *filetype;		// NULL until a tile is put
+	int minzoom;
+	int maxzoom;
+	struct dedup_stats stats;
+};
+
+// A name for a temporary file beside fname that no other thread or
+// process writing the same tiles will also be using
+void writer_tempname(char *out, char *fname) {
+	sprintf(out, "%s.%ld.%lx.tmp", fname, (long) getpid(), (unsigned long) pthread_self());
+}
+
+struct writer *writer_open(char *outdir, int dedup) {
+	struct writer *w = malloc(sizeof(struct writer));
+	if (w == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(w, 0, sizeof(struct writer));
+	w->outdir = outdir;
+	w->dedup = dedup;
+
+	if (mbtiles_is(outdir)) {
+		w->mb = mbtiles_open(outdir, dedup);
+		w->dedup = mbtiles_dedup(w->mb);
+	} else if (mkdir(outdir, 0777) != 0 && access(outdir, W_OK) != 0) {
+		perror(outdir);
+		exit(EXIT_FAILURE);
+	}
+
+	w->dirsize = 1024;
+	w->dirs = calloc(w->dirsize, sizeof(unsigned long long));
+	if (w->dirs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	return w;
+}
+
+// Never 0, which marks an empty slot. Zoom directories are the ones
+// without the low bit set.
+static unsigned long long dirkey(int z, unsigned int x, int isx) {
+	return ((unsigned long long) (z + 1) << 33) | ((unsigned long long) x << 1) | isx;
+}
+
+static unsigned long long *dirslot(unsigned long long *dirs, size_t size, unsigned long long key) {
+	size_t i = (key * 0x9E3779B97F4A7C15ULL) >> 20;
+
+	for (i &= size - 1; dirs[i] != 0 && dirs[i] != key; i = (i + 1) & (size - 1)) {
+		;
+	}
+
+	return &dirs[i];
+}
+
+// Make the directory unless it is already known to be there
+static void need_dir(struct writer *w, char *path, unsigned long long key) {
+	pthread_mutex_lock(&w->lock);
+	int known = *dirslot(w->dirs, w->dirsize, key) != 0;
+	pthread_mutex_unlock(&w->lock);
+
+	if (known) {
+		return;
+	}
+
+	if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	if (2 * (w->ndirs + 1) > w->dirsize) {
+		size_t size = w->dirsize * 2;
+		unsigned long long *dirs = calloc(size, sizeof(unsigned long long));
+		if (dirs == NULL) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+		size_t i;
+		for (i = 0; i < w->dirsize; i++) {
+			if (w->dirs[i] != 0) {
+				*dirslot(dirs, size, w->dirs[i]) = w->dirs[i];
+			}
+		}
+
+		free(w->dirs);
+		w->dirs = dirs;
+		w->dirsize = size;
+	}
+
+	unsigned long long *slot = dirslot(w->dirs, w->dirsize, key);
+	if (*slot == 0) {
+		*slot = key;
+		w->ndirs++;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Write the tile to a temporary file and rename it into place, so that
+// nothing reading the directory ever sees half of a tile
+static void write_file(char *path, char *data, size_t len) {
+	char tmp[strlen(path) + 50];
+	writer_tempname(tmp, path);
+
+	FILE *fp = fopen(tmp, "wb");
+	if (fp == NULL) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+	if (fwrite(data, 1, len, fp) != len || fclose(fp) != 0) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(tmp, path) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void writer_put(struct writer *w, int z, unsigned int x, unsigned int y, char *filetype, char *data, size_t len) {
+	struct dedup_stats st;
+	memset(&st, 0, sizeof(st));
+
+	if (w->mb != NULL) {
+		mbtiles_put(w->mb, z, x, y, data, len);
+	} else {
+		char path[strlen(w->outdir) + 12 + 12 + 12 + 5];
+
+		sprintf(path, "%s/%d", w->outdir, z);
+		need_dir(w, path, dirkey(z, 0, 0));
+
+		sprintf(path, "%s/%d/%u", w->outdir, z, x);
+		need_dir(w, path, dirkey(z, x, 1));
+
+		sprintf(path, "%s/%d/%u/%u.%s", w->outdir, z, x, y, filetype);
+
+		if (w->dedup) {
+			dedup_write(w->outdir, path, filetype, data, len, &st);
+		} else {
+			write_file(path, data, len);
+		}
+
+		free(data);
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->filetype == NULL) {
+		w->filetype = filetype;
+		w->minzoom = w->maxzoom = z;
+	}
+	if (z < w->minzoom) {
+		w->minzoom = z;
+	}
+	if (z > w->maxzoom) {
+		w->maxzoom = z;
+	}
+
+	w->stats.tiles += st.tiles;
+	w->stats.distinct += st.distinct;
+	w->stats.bytes += st.bytes;
+	w->stats.saved += st.saved;
+
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void quote(FILE *fp, char *s) {
+	fprintf(fp, "\"");
+	for (; *s != '\0'; s++) {
+		if (*s == '\\' || *s == '\"') {
+			fputc('\\', fp);
+			fputc(*s, fp);
+		} else if (*s < ' ') {
+			fprintf(fp, "\\u%04x", *s);
+		} else {
+			fputc(*s, fp);
+		}
+	}
+	fprintf(fp, "\"");
+}
+
+// The zoom that metadata.json from an earlier run says, if there is one
+static void old_zoom(char *text, char *name, int *zoom, int bigger) {
+	char key[30];
+	sprintf(key, "\"%s\": ", name);
+
+	char *s = strstr(text, key);
+	if (s != NULL) {
+		int n = atoi(s + strlen(key));
+
+		if (bigger ? n > *zoom : n < *zoom) {
+			*zoom = n;
+		}
+	}
+}
+
+// The metadata for the tileset, which goes into metadata.json for mbutil
+// in a directory, or into the metadata table of an MBTiles file. Other
+// processes may be writing tiles into the same place, so the zooms they
+// wrote are kept too.
+static void write_metadata(struct writer *w, char *fname) {
+	char *filetype = w->filetype;
+	int minzoom = w->minzoom, maxzoom = w->maxzoom;
+	int fd = -1;
+
+	if (w->mb != NULL) {
+		int lo, hi;
+
+		if (mbtiles_zooms(w->mb, &lo, &hi)) {
+			if (lo < minzoom) {
+				minzoom = lo;
+			}
+			if (hi > maxzoom) {
+				maxzoom = hi;
+			}
+		}
+	} else {
+		// Hold the directory locked from reading the old
+		// metadata until the new one is in place
+		fd = open(w->outdir, O_RDONLY);
+		if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+			perror(w->outdir);
+			exit(EXIT_FAILURE);
+		}
+
+		char path[strlen(w->outdir) + 15];
+		sprintf(path, "%s/metadata.json", w->outdir);
+
+		FILE *fp = fopen(path, "r");
+		if (fp != NULL) {
+			char text[2000];
+			size_t n = fread(text, 1, sizeof(text) - 1, fp);
+			text[n] = '\0';
+			fclose(fp);
+
+			old_zoom(text, "minzoom", &minzoom, 0);
+			old_zoom(text, "maxzoom", &maxzoom, 1);
+		}
+	}
+
+	char json[500];
+	snprintf(json, sizeof(json), "{\"vector_layers\": [ { \"id\": \"points\", \"description\": \"\", \"minzoom\": %d, \"maxzoom\": %d, \"fields\": {\"meta\": \"Number\" } }, { \"id\": \"lines\", \"description\": \"\", \"minzoom\": %d, \"maxzoom\": %d, \"fields\": {\"meta\": \"Number\" } } ]}", minzoom, maxzoom, minzoom, maxzoom);
+
+	if (w->mb != NULL) {
+		char num[12];
+
+		mbtiles_metadata(w->mb, "name", w->outdir);
+		mbtiles_metadata(w->mb, "description", fname);
+		mbtiles_metadata(w->mb, "version", "1");
+		sprintf(num, "%d", minzoom);
+		mbtiles_metadata(w->mb, "minzoom", num);
+		sprintf(num, "%d", maxzoom);
+		mbtiles_metadata(w->mb, "maxzoom", num);
+		mbtiles_metadata(w->mb, "type", "overlay");
+		if (strcmp(filetype, "pbf") == 0) {
+			mbtiles_metadata(w->mb, "json", json);
+		}
+		mbtiles_metadata(w->mb, "format", filetype);
+		return;
+	}
+
+	char path[strlen(w->outdir) + 15];
+	sprintf(path, "%s/metadata.json", w->outdir);
+
+	char tmp[strlen(path) + 50];
+	writer_tempname(tmp, path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(fp, "{\n");
+
+	fprintf(fp, "\"name\": ");
+	quote(fp, w->outdir);
+	fprintf(fp, ",\n");
+
+	fprintf(fp, "\"description\": ");
+	quote(fp, fname);
+	fprintf(fp, ",\n");
+
+	fprintf(fp, "\"version\": 1,\n");
+	fprintf(fp, "\"minzoom\": %d,\n", minzoom);
+	fprintf(fp, "\"maxzoom\": %d,\n", maxzoom);
+	fprintf(fp, "\"type\": \"overlay\",\n");
+
+	if (strcmp(filetype, "pbf") == 0) {
+		fprintf(fp, "\"json\": ");
+		quote(fp, json);
+		fprintf(fp, ",\n");
+	}
+
+	fprintf(fp, "\"format\": \"%s\"\n", filetype); // no trailing comma
+	fprintf(fp, "}\n");
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+}
+
+int writer_close(struct writer *w, char *fname, struct dedup_stats *st) {
+	int dedup = w->dedup;
+
+	if (w->filetype != NULL) {
+		write_metadata(w, fname);
+	}
+
+	*st = w->stats;
+	if (w->mb != NULL) {
+		if (dedup) {
+			mbtiles_stats(w->mb, st);
+		}
+		mbtiles_close(w->mb);
+	}
+
+	pthread_mutex_destroy(&w->lock);
+	free(w->dirs);
+	free(w);
+	return dedup;
+}
@@ -0,0 +1,18 @@
+// Where finished tiles go: a directory of z/x/y files, or an MBTiles
+// file. Any number of threads can put tiles at once. The zooms that
+// were written are kept track of as the tiles go by, so the metadata
+// is written only once, when the writer is closed.
+
+struct writer;
+struct dedup_stats;
+
+struct writer *writer_open(char *outdir, int dedup);
+
+// Takes over data, which must have come from malloc
+void writer_put(struct writer *w, int z, unsigned int x, unsigned int y, char *filetype, char *data, size_t len);
+
+// Writes the metadata for fname, and fills in st if the tiles
+// were deduplicated. Returns whether they were.
+int writer_close(struct writer *w, char *fname, struct dedup_stats *st);
+
+void writer_tempname(char *out, char *fname);